@@ -0,0 +1,346 @@
+#include "ans.h"
+#include "check.h"
+
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+
+static unsigned highest_bit(uint32_t value) {
+    return 31 - __builtin_clz(value);
+}
+
+// Positions of the symbols in the state table, spread so that every symbol covers all of it evenly
+static std::vector<uint8_t> spread(const ans::Normalized& normalized) {
+    constexpr uint32_t step = (ans::TABLE_SIZE >> 1) + (ans::TABLE_SIZE >> 3) + 3;
+    std::vector<uint8_t> symbols(ans::TABLE_SIZE);
+    uint32_t position = 0;
+    for (unsigned symbol = 0; symbol < 0x100; ++symbol) {
+        for (uint32_t i = 0; i < normalized[symbol]; ++i) {
+            symbols[position] = static_cast<uint8_t>(symbol);
+            position = (position + step) & (ans::TABLE_SIZE - 1);
+        }
+    }
+    return symbols;
+}
+
+static bool is_normalized(const ans::Normalized& normalized) {
+    uint64_t sum = 0;
+    for (auto count : normalized) {
+        sum += count;
+    }
+    return sum == ans::TABLE_SIZE;
+}
+
+namespace {
+// Bits are appended above the ones written before
+struct BitWriter {
+    std::string& out;
+    uint64_t buffer = 0;
+    unsigned count = 0;
+
+    void put(uint32_t value, unsigned bits) {
+        buffer |= static_cast<uint64_t>(value & ((1u << bits) - 1)) << count;
+        count += bits;
+        if (count >= 32) {
+            auto word = static_cast<uint32_t>(buffer);
+            out.append(reinterpret_cast<const char*>(&word), sizeof(word));
+            buffer >>= 32;
+            count -= 32;
+        }
+    }
+
+    void finish() {
+        put(1, 1);
+        for (; count > 0; count = count > 8 ? count - 8 : 0) {
+            out.push_back(static_cast<char>(buffer));
+            buffer >>= 8;
+        }
+    }
+};
+
+// Takes the bits back from the highest down
+struct BitReader {
+    const char* data;
+    size_t size;
+    size_t bit; // bits left
+
+    uint32_t get(unsigned bits) {
+        bit -= bits;
+        size_t byte = bit / 8;
+        uint64_t window = 0;
+        if (byte + sizeof(window) <= size) {
+            std::memcpy(&window, data + byte, sizeof(window));
+        } else {
+            std::memcpy(&window, data + byte, size - byte);
+        }
+        return static_cast<uint32_t>(window >> (bit % 8)) & ((1u << bits) - 1);
+    }
+};
+}
+
+ans::Normalized ans::normalize(const huffman::freq_t* counts) {
+    Normalized normalized{};
+    uint64_t total = 0;
+    for (unsigned symbol = 0; symbol < 0x100; ++symbol) {
+        total += counts[symbol];
+    }
+    if (total == 0) {
+        return normalized;
+    }
+    int64_t left = TABLE_SIZE;
+    for (unsigned symbol = 0; symbol < 0x100; ++symbol) {
+        if (counts[symbol] != 0) {
+            auto scaled = static_cast<uint32_t>((static_cast<long double>(counts[symbol]) * TABLE_SIZE + total / 2) / total);
+            normalized[symbol] = std::max(scaled, 1u);
+            left -= normalized[symbol];
+        }
+    }
+    // the rounding error goes to the largest counts, where it costs the least
+    while (left != 0) {
+        auto largest = std::max_element(normalized.begin(), normalized.end());
+        if (left > 0) {
+            *largest += left;
+            break;
+        }
+        uint32_t taken = std::min<uint32_t>(static_cast<uint32_t>(-left), (*largest + 1) / 2);
+        *largest -= taken;
+        left += taken;
+    }
+    return normalized;
+}
+
+void ans::encode_table(std::ostream& os, const Normalized& normalized) {
+    auto alphabet_size = static_cast<uint16_t>(normalized.size() - std::count(normalized.begin(), normalized.end(), 0u));
+    os.write(reinterpret_cast<char*>(&alphabet_size), sizeof(alphabet_size));
+    for (unsigned symbol = 0; symbol < 0x100; ++symbol) {
+        if (normalized[symbol] != 0) {
+            auto count = static_cast<uint16_t>(normalized[symbol]);
+            os.put(static_cast<char>(symbol));
+            os.write(reinterpret_cast<char*>(&count), sizeof(count));
+        }
+    }
+}
+
+// All zeros for a malformed table
+ans::Normalized ans::decode_table(std::istream& is) {
+    Normalized normalized{};
+    uint16_t alphabet_size;
+    if (!is.read(reinterpret_cast<char*>(&alphabet_size), sizeof(alphabet_size))) {
+        return {};
+    }
+    for (; alphabet_size > 0; --alphabet_size) {
+        char symbol;
+        uint16_t count;
+        if (!is.get(symbol) || !is.read(reinterpret_cast<char*>(&count), sizeof(count))) {
+            return {};
+        }
+        normalized[static_cast<unsigned char>(symbol)] = count;
+    }
+    return is_normalized(normalized) ? normalized : Normalized{};
+}
+
+ans::EncodingTable ans::encoding_table(const Normalized& normalized) {
+    EncodingTable table{std::vector<uint16_t>(TABLE_SIZE), {}};
+    if (!is_normalized(normalized)) {
+        return table;
+    }
+    std::array<uint32_t, 0x101> starts{};
+    for (unsigned symbol = 0; symbol < 0x100; ++symbol) {
+        starts[symbol + 1] = starts[symbol] + normalized[symbol];
+    }
+    auto next = starts;
+    auto symbols = spread(normalized);
+    for (uint32_t position = 0; position < TABLE_SIZE; ++position) {
+        table.states[next[symbols[position]]++] = static_cast<uint16_t>(TABLE_SIZE + position);
+    }
+    for (unsigned symbol = 0; symbol < 0x100; ++symbol) {
+        uint32_t count = normalized[symbol];
+        if (count == 0) {
+            continue;
+        }
+        // states [count << bits, 2 * count << bits) put out `bits` bits, the ones below one bit less
+        uint32_t bits = count == 1 ? TABLE_LOG : TABLE_LOG - highest_bit(count - 1);
+        table.symbols[symbol] = {(bits << 16) - (count << bits), static_cast<int32_t>(starts[symbol]) - static_cast<int32_t>(count)};
+    }
+    return table;
+}
+
+ans::DecodingTable ans::decoding_table(const Normalized& normalized) {
+    if (!is_normalized(normalized)) {
+        return {};
+    }
+    DecodingTable table(TABLE_SIZE);
+    auto next = normalized;
+    auto symbols = spread(normalized);
+    for (uint32_t position = 0; position < TABLE_SIZE; ++position) {
+        uint8_t symbol = symbols[position];
+        uint32_t state = next[symbol]++;
+        auto bits = static_cast<uint8_t>(TABLE_LOG - highest_bit(state));
+        table[position] = {static_cast<uint16_t>((state << bits) - TABLE_SIZE), symbol, bits};
+    }
+    return table;
+}
+
+EncodingStats ans::encode_block(const char* data, size_t size, std::string& out, const EncodingTable& table) {
+    size_t header = out.size();
+    out.resize(header + sizeof(huffman::BlockHeader));
+    BitWriter writer{out};
+    uint32_t states[STATES] = {TABLE_SIZE, TABLE_SIZE, TABLE_SIZE, TABLE_SIZE};
+    auto step = [&](uint32_t& state, char c) {
+        const SymbolTransform& transform = table.symbols[static_cast<unsigned char>(c)];
+        uint32_t bits = (state + transform.delta_bits) >> 16;
+        writer.put(state, bits);
+        state = table.states[(state >> bits) + transform.delta_state];
+    };
+    // symbol i belongs to state i % STATES, the decoder starts from the first one
+    size_t i = size;
+    for (; i % STATES != 0; --i) {
+        step(states[(i - 1) % STATES], data[i - 1]);
+    }
+    for (; i > 0; i -= STATES) {
+        step(states[3], data[i - 1]);
+        step(states[2], data[i - 2]);
+        step(states[1], data[i - 3]);
+        step(states[0], data[i - 4]);
+    }
+    for (int k = STATES - 1; k >= 0; --k) {
+        writer.put(states[k] - TABLE_SIZE, TABLE_LOG);
+    }
+    writer.finish();
+    huffman::BlockHeader block{static_cast<uint32_t>(out.size() - header - sizeof(huffman::BlockHeader)),
+                               static_cast<uint32_t>(size)};
+    std::memcpy(out.data() + header, &block, sizeof(block));
+    return {out.size() - header, size};
+}
+
+// Returns the symbols decoded, fewer than `symbols` for a malformed body
+size_t ans::decode_block(const DecodingTable& table, const char* data, size_t size, size_t symbols, char* out) {
+    if (table.empty() || size == 0 || data[size - 1] == 0) {
+        return 0;
+    }
+    BitReader reader{data, size, (size - 1) * 8 + highest_bit(static_cast<unsigned char>(data[size - 1]))};
+    if (reader.bit < STATES * TABLE_LOG) {
+        return 0;
+    }
+    uint32_t states[STATES];
+    for (auto& state : states) {
+        state = reader.get(TABLE_LOG);
+    }
+    // a group of STATES symbols takes at most STATES * TABLE_LOG bits, all of them from one 64-bit load
+    static_assert(STATES * TABLE_LOG <= 56);
+    size_t i = 0;
+    for (; symbols - i >= STATES && reader.bit >= 56 && (reader.bit - 56) / 8 + 8 <= size; i += STATES) {
+        size_t low = reader.bit - 56;
+        uint64_t window;
+        std::memcpy(&window, data + low / 8, sizeof(window));
+        low -= low % 8;
+        for (int k = 0; k < STATES; ++k) {
+            DecodeEntry entry = table[states[k]];
+            out[i + k] = static_cast<char>(entry.symbol);
+            reader.bit -= entry.bits;
+            states[k] = entry.base + (static_cast<uint32_t>(window >> (reader.bit - low)) & ((1u << entry.bits) - 1));
+        }
+    }
+    for (; i < symbols; ++i) {
+        DecodeEntry entry = table[states[i % STATES]];
+        if (entry.bits > reader.bit) {
+            return i;
+        }
+        out[i] = static_cast<char>(entry.symbol);
+        states[i % STATES] = entry.base + reader.get(entry.bits);
+    }
+    // the encoder starts every state at TABLE_SIZE, and its first bits are the last ones read
+    bool finished = reader.bit == 0 && std::all_of(states, states + STATES, [](uint32_t state) { return state == 0; });
+    return finished ? i : 0;
+}
+
+EncodingStats ans::encode(std::istream& is, std::ostream& os) {
+    std::string input = (std::ostringstream{} << is.rdbuf()).str();
+    huffman::freq_t counts[0x100] = {};
+    huffman::histogram(input.data(), input.size(), counts);
+    auto normalized = normalize(counts);
+    auto table = encoding_table(normalized);
+    std::ostringstream head;
+    head.write(reinterpret_cast<const char*>(&CONTAINER), sizeof(Header));
+    encode_table(head, normalized);
+    std::string blocks;
+    for (size_t i = 0; i < input.size(); i += huffman::PART_SIZE) {
+        encode_block(input.data() + i, std::min(input.size() - i, static_cast<size_t>(huffman::PART_SIZE)), blocks, table);
+    }
+    os << head.str() << blocks;
+    huffman::encode_index(os, huffman::index_blocks(blocks, head.tellp()));
+    return {static_cast<size_t>(head.tellp()) + blocks.size(), input.size()};
+}
+
+// False on a malformed container, the blocks before the malformed one are written
+bool ans::decode(std::istream& is, std::ostream& os) {
+    char header[sizeof(Header)];
+    if (!is.read(header, sizeof(header)) || !container::has_magic(header, sizeof(header), CONTAINER)) {
+        return false;
+    }
+    auto table = decoding_table(decode_table(is));
+    huffman::BlockHeader block{};
+    while (is.read(reinterpret_cast<char*>(&block), sizeof(block)) && block.length != 0) {
+        std::string body(block.length, '\0');
+        if (!is.read(body.data(), block.length)) {
+            return false;
+        }
+        std::string output(block.symbols, '\0');
+        if (decode_block(table, body.data(), body.size(), block.symbols, output.data()) != block.symbols) {
+            return false;
+        }
+        os.write(output.data(), static_cast<std::streamsize>(output.size()));
+    }
+    // the empty BlockHeader before the index ends the blocks
+    return static_cast<bool>(is);
+}
+
+void test_ans() {
+    // one symbol, every byte value, and rare bytes that keep a single state each;
+    // block sizes that are and are not a multiple of STATES
+    std::string bytes;
+    for (int i = 0; i < 100 * 0x100 + 3; ++i) {
+        bytes.push_back(static_cast<char>(i * 7));
+    }
+    std::string skewed(30'001, 'a');
+    for (size_t i = 0; i < skewed.size(); i += 1000) {
+        skewed[i] = static_cast<char>('b' + i / 1000 % 20);
+    }
+    for (const std::string& subject : {std::string{}, std::string{"a"}, std::string{"abcde"},
+                                      std::string(25'000, 'x'), bytes, skewed}) {
+        huffman::freq_t counts[0x100] = {};
+        huffman::histogram(subject.data(), subject.size(), counts);
+        CHECK(subject.empty() || is_normalized(ans::normalize(counts)));
+        std::istringstream raw{subject};
+        std::stringstream coded;
+        ans::encode(raw, coded);
+        std::stringstream result;
+        ans::decode(coded, result);
+        CHECK(result.str() == subject);
+    }
+    huffman::freq_t counts[0x100] = {};
+    huffman::histogram(skewed.data(), skewed.size(), counts);
+    auto normalized = ans::normalize(counts);
+    std::string block;
+    ans::encode_block(skewed.data(), 1001, block, ans::encoding_table(normalized));
+    std::string output(1001, '\0');
+    std::string body = block.substr(sizeof(huffman::BlockHeader));
+    auto decoding = ans::decoding_table(normalized);
+    size_t produced = ans::decode_block(decoding, body.data(), body.size(), 1001, output.data());
+    CHECK(produced == 1001 && output == skewed.substr(0, 1001));
+    // a body without its end marker or without its first bytes is malformed
+    produced = ans::decode_block(decoding, body.data(), body.size() - 1, 1001, output.data());
+    CHECK(produced < 1001);
+    produced = ans::decode_block(decoding, body.data() + 1, body.size() - 1, 1001, output.data());
+    CHECK(produced < 1001);
+    // so is a container cut inside a block, the blocks before it are written
+    std::istringstream raw{skewed};
+    std::stringstream coded;
+    ans::encode(raw, coded);
+    std::string container = coded.str();
+    auto index = huffman::decode_index(container);
+    std::istringstream cut{container.substr(0, index.back().offset + sizeof(huffman::BlockHeader) + 3)};
+    std::ostringstream result;
+    bool intact = ans::decode(cut, result);
+    CHECK(!intact && result.str() == skewed.substr(0, skewed.size() - index.back().block.symbols));
+}
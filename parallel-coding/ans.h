@@ -0,0 +1,55 @@
+#pragma once
+#include "container.h"
+#include "huffman.h"
+
+#include <array>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+
+// Table-based asymmetric numeral systems with STATES interleaved states
+namespace ans {
+    constexpr unsigned TABLE_LOG = 12;
+    constexpr uint32_t TABLE_SIZE = 1u << TABLE_LOG;
+    constexpr int STATES = 4;
+
+    // Container: Header | table | then the blocks and the index of the Huffman container.
+    // A block body is a bit stream written from its last symbol to its first and read backwards,
+    // its highest set bit marks the end.
+    using container::Header;
+    constexpr Header CONTAINER{{'P', 'C', 'A', 'N'}, 1, 0, 0};
+
+    // Frequencies scaled to sum up to TABLE_SIZE, every present byte keeps at least 1
+    using Normalized = std::array<uint32_t, 0x100>;
+
+    struct SymbolTransform {
+        uint32_t delta_bits; // (bits << 16) - (count << bits), the state adds it to find its bits
+        int32_t delta_state; // start of the symbol in the state table minus its count
+    };
+    struct EncodingTable {
+        std::vector<uint16_t> states; // next encoder states, TABLE_SIZE + position
+        std::array<SymbolTransform, 0x100> symbols;
+    };
+
+    struct DecodeEntry {
+        uint16_t base; // next state without the bits read
+        uint8_t symbol;
+        uint8_t bits;
+    };
+    using DecodingTable = std::vector<DecodeEntry>;
+
+    Normalized normalize(const huffman::freq_t* counts);
+    void encode_table(std::ostream& os, const Normalized& normalized);
+    Normalized decode_table(std::istream& is);
+    EncodingTable encoding_table(const Normalized& normalized);
+    DecodingTable decoding_table(const Normalized& normalized);
+    EncodingStats encode_block(const char* data, size_t size, std::string& out, const EncodingTable& table);
+    size_t decode_block(const DecodingTable& table, const char* data, size_t size, size_t symbols, char* out);
+
+    EncodingStats encode(std::istream& is, std::ostream& os);
+    bool decode(std::istream& is, std::ostream& os); // false when malformed
+}
+
+void test_ans();
@@ -0,0 +1,325 @@
+// Single-process throughput of the codecs on generated corpora, CSV or JSON on stdout
+#include "huffman.h"
+#include "runlength.h"
+#include "lzw.h"
+#include "ans.h"
+#include "crc32c.h"
+
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <sstream>
+#include <iostream>
+#include <functional>
+
+struct Corpus {
+    std::string kind;
+    std::string data;
+};
+
+struct Result {
+    std::string corpus;
+    size_t size; // bytes
+    double entropy; // bits per byte
+    std::string operation;
+    double seconds; // best run
+};
+
+const char *KINDS[] = {"uniform", "text", "skewed", "runs"};
+
+// Deterministic corpora: uniform bytes, 25 letters like `generate`, geometric letters, runs of 4 letters
+std::string make_corpus(const std::string &kind, size_t size) {
+    std::mt19937 generator{42};
+    std::string data;
+    data.reserve(size);
+    if (kind == "uniform") {
+        std::uniform_int_distribution<int> byte(0, 0xff);
+        while (data.size() < size) {
+            data.push_back(static_cast<char>(byte(generator)));
+        }
+    } else if (kind == "text") {
+        std::uniform_int_distribution<int> letter(0, 24);
+        while (data.size() < size) {
+            data.push_back(static_cast<char>('a' + letter(generator)));
+        }
+    } else if (kind == "skewed") {
+        std::geometric_distribution<int> letter(0.5);
+        while (data.size() < size) {
+            data.push_back(static_cast<char>('a' + std::min(letter(generator), 15)));
+        }
+    } else if (kind == "runs") {
+        std::uniform_int_distribution<int> letter(0, 3);
+        std::uniform_int_distribution<size_t> run(1, 64);
+        while (data.size() < size) {
+            data.append(std::min(run(generator), size - data.size()), static_cast<char>('a' + letter(generator)));
+        }
+    } else {
+        return {};
+    }
+    return data;
+}
+
+std::vector<huffman::freq_t> counts_of(const std::string &data) {
+    std::vector<huffman::freq_t> counts(0x100);
+    huffman::histogram(data.data(), data.size(), counts.data());
+    return counts;
+}
+
+double entropy(const std::string &data) {
+    auto counts = counts_of(data);
+    double bits = 0;
+    for (auto count : counts) {
+        if (count != 0) {
+            double p = static_cast<double>(count) / static_cast<double>(data.size());
+            bits -= p * std::log2(p);
+        }
+    }
+    return bits;
+}
+
+// Best of as many runs as fit into min_time seconds, at least one
+double measure(const std::function<void()> &run, double min_time) {
+    using clock = std::chrono::steady_clock;
+    double best = INFINITY;
+    double total = 0;
+    for (int i = 0; i < 100 && (i == 0 || total < min_time); ++i) {
+        auto start = clock::now();
+        run();
+        double seconds = std::chrono::duration<double>(clock::now() - start).count();
+        best = std::min(best, seconds);
+        total += seconds;
+    }
+    return best;
+}
+
+// False when a decoder does not give the corpus back
+bool bench_corpus(const Corpus &corpus, double min_time, std::vector<Result> &results) {
+    const std::string &data = corpus.data;
+    double bits = entropy(data);
+    auto add = [&](const std::string &operation, const std::function<void()> &run) {
+        results.push_back({corpus.kind, data.size(), bits, operation, measure(run, min_time)});
+    };
+    bool intact = true;
+    auto check = [&](const std::string &operation, const std::string &decoded) {
+        if (decoded != data) {
+            std::cerr << corpus.kind << ' ' << operation << ": decoded output differs from the input\n";
+            intact = false;
+        }
+    };
+    std::string decoded;
+
+    add("crc32c::checksum", [&] {
+        volatile uint32_t crc = crc32c::checksum(data.data(), data.size());
+        (void) crc;
+    });
+    huffman::FrequencyMap frequencies;
+    add("huffman::frequencies", [&] {
+        std::istringstream is{data};
+        frequencies = huffman::frequencies(is);
+    });
+    huffman::Coding coding;
+    add("huffman::coding", [&] {
+        coding = huffman::coding(frequencies);
+    });
+    auto table = huffman::code_table(coding.coding);
+    std::string encoded;
+    add("huffman::encode_body", [&] {
+        std::ostringstream os;
+        huffman::encode_head(os, coding.coding);
+        // a legacy stream has a body of its own for every part, decode_body expects their padding prefixes
+        for (size_t i = 0; i < data.size(); i += huffman::PART_SIZE) {
+            std::string part = data.substr(i, huffman::PART_SIZE);
+            size_t body_size_bits = 0;
+            for (char symbol : part) {
+                body_size_bits += table[static_cast<unsigned char>(symbol)].length;
+            }
+            std::istringstream is{part};
+            huffman::encode_body(is, os, coding.coding, coding.longest, body_size_bits);
+        }
+        encoded = os.str();
+    });
+    add("huffman::decode_body", [&] {
+        std::istringstream is{encoded};
+        std::ostringstream os;
+        huffman::decode_body(huffman::decode_head(is), is, os);
+        decoded = os.str();
+    });
+    check("huffman::decode_body", decoded);
+    std::string blocks;
+    add("huffman::encode_block", [&] {
+        blocks.clear();
+        for (size_t i = 0; i < data.size(); i += huffman::PART_SIZE) {
+            size_t size = std::min(data.size() - i, static_cast<size_t>(huffman::PART_SIZE));
+            huffman::encode_block(data.data() + i, size, blocks, table, coding.longest, 0);
+        }
+    });
+    std::string streams;
+    add("huffman::encode_streams", [&] {
+        streams.clear();
+        for (size_t i = 0; i < data.size(); i += huffman::PART_SIZE) {
+            size_t size = std::min(data.size() - i, static_cast<size_t>(huffman::PART_SIZE));
+            huffman::encode_block(data.data() + i, size, streams, table, coding.longest, huffman::STREAMS);
+        }
+    });
+    std::istringstream head{encoded};
+    auto decoding = huffman::decoding_table(huffman::decode_head(head));
+    add("huffman::decode_block", [&] {
+        std::istringstream is{blocks};
+        std::ostringstream os;
+        huffman::BlockHeader block{};
+        while (is.read(reinterpret_cast<char*>(&block), sizeof(block))) {
+            huffman::decode_block(decoding, is, os, block, 0);
+        }
+        decoded = os.str();
+    });
+    check("huffman::decode_block", decoded);
+    // the bit decoders alone, without the stream plumbing of decode_block
+    std::string output(data.size(), '\0');
+    auto block_index = huffman::index_blocks(blocks, 0);
+    add("huffman::decode_bits", [&] {
+        size_t produced = 0;
+        for (auto &block : block_index) {
+            size_t bit = 2;
+            produced += huffman::decode_bits(decoding, blocks.data() + block.offset + sizeof(huffman::BlockHeader),
+                                             bit, block.block.length * 8, block.block.symbols, output.data() + produced);
+        }
+    });
+    check("huffman::decode_bits", output);
+    std::fill(output.begin(), output.end(), '\0');
+    auto stream_index = huffman::index_blocks(streams, 0);
+    add("huffman::decode_streams", [&] {
+        size_t produced = 0;
+        for (auto &block : stream_index) {
+            produced += huffman::decode_streams(decoding, streams.data() + block.offset + sizeof(huffman::BlockHeader),
+                                                block.block.length, block.block.symbols, output.data() + produced);
+        }
+    });
+    check("huffman::decode_streams", output);
+    auto normalized = ans::normalize(counts_of(data).data());
+    auto ans_table = ans::encoding_table(normalized);
+    std::string states;
+    add("ans::encode_block", [&] {
+        states.clear();
+        for (size_t i = 0; i < data.size(); i += huffman::PART_SIZE) {
+            size_t size = std::min(data.size() - i, static_cast<size_t>(huffman::PART_SIZE));
+            ans::encode_block(data.data() + i, size, states, ans_table);
+        }
+    });
+    auto ans_decoding = ans::decoding_table(normalized);
+    add("ans::decode_block", [&] {
+        output.assign(data.size(), '\0');
+        auto index = huffman::index_blocks(states, 0);
+        size_t produced = 0;
+        for (auto &block : index) {
+            produced += ans::decode_block(ans_decoding, states.data() + block.offset + sizeof(huffman::BlockHeader),
+                                          block.block.length, block.block.symbols, output.data() + produced);
+        }
+    });
+    check("ans::decode_block", output);
+    std::string runs;
+    add("rle::encode", [&] {
+        std::istringstream is{data};
+        std::ostringstream os;
+        rle::encode(is, os);
+        runs = os.str();
+    });
+    add("rle::decode", [&] {
+        std::istringstream is{runs};
+        std::ostringstream os;
+        rle::decode(is, os);
+        decoded = os.str();
+    });
+    check("rle::decode", decoded);
+    std::string phrases;
+    add("lzw::encode", [&] {
+        std::istringstream is{data};
+        std::ostringstream os;
+        lzw::encode(is, os);
+        phrases = os.str();
+    });
+    add("lzw::decode", [&] {
+        std::istringstream is{phrases};
+        std::ostringstream os;
+        lzw::decode(is, os);
+        decoded = os.str();
+    });
+    check("lzw::decode", decoded);
+    return intact;
+}
+
+void print_csv(const std::vector<Result> &results) {
+    std::cout << "corpus,size,entropy,operation,seconds,mb_per_s\n";
+    for (auto &result : results) {
+        std::cout
+            << result.corpus << ',' << result.size << ',' << result.entropy << ','
+            << result.operation << ',' << result.seconds << ','
+            << static_cast<double>(result.size) / 1e6 / result.seconds << '\n';
+    }
+}
+
+void print_json(const std::vector<Result> &results) {
+    std::cout << "[\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto &result = results[i];
+        std::cout
+            << "  {\"corpus\": \"" << result.corpus << "\", \"size\": " << result.size
+            << ", \"entropy\": " << result.entropy << ", \"operation\": \"" << result.operation
+            << "\", \"seconds\": " << result.seconds
+            << ", \"mb_per_s\": " << static_cast<double>(result.size) / 1e6 / result.seconds << '}'
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    std::cout << "]\n";
+}
+
+// benchmark [--json] [--sizes MIB,...] [--min-time SECONDS]
+// benchmark corpus KIND BYTES
+// benchmark test
+int main(int argc, const char *argv[]) {
+    if (argc == 2 && strcmp(argv[1], "test") == 0) {
+        test_huffman();
+        test_header();
+        test_canonical();
+        test_local_tables();
+        test_long_codes();
+        test_rle();
+        test_lzw();
+        test_crc32c();
+        test_ans();
+        std::cout << "tests passed\n";
+        return EXIT_SUCCESS;
+    }
+    if (argc == 4 && strcmp(argv[1], "corpus") == 0) {
+        auto data = make_corpus(argv[2], std::strtoull(argv[3], nullptr, 10));
+        std::cout << data;
+        return data.empty() ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    bool json = false;
+    std::vector<size_t> sizes = {1, 16};
+    double min_time = 0.2;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            sizes.clear();
+            std::istringstream is {argv[++i]};
+            for (std::string size; std::getline(is, size, ','); ) {
+                sizes.push_back(std::stoul(size));
+            }
+        } else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            min_time = std::atof(argv[++i]);
+        } else {
+            std::cerr << "unknown option " << argv[i] << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+    std::vector<Result> results;
+    bool intact = true;
+    for (size_t size : sizes) {
+        for (auto kind : KINDS) {
+            intact = bench_corpus({kind, make_corpus(kind, size << 20)}, min_time, results) && intact;
+        }
+    }
+    json ? print_json(results) : print_csv(results);
+    return intact ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+
+// Condition of the codec tests, checked in every build type: a Release build defines NDEBUG and drops asserts
+#define CHECK(condition) ((condition) ? void(0) : check_failed(#condition, __FILE__, __LINE__))
+
+[[noreturn]] inline void check_failed(const char* condition, const char* file, int line) {
+    std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, condition);
+    std::abort();
+}
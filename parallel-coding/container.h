@@ -0,0 +1,22 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Every codec container starts with this header, the codec keeps its own magic and version in a CONTAINER constant
+namespace container {
+    struct Header {
+        char magic[4];
+        uint8_t version;
+        uint8_t flags;
+        uint16_t reserved;
+    };
+    static_assert(sizeof(Header) == 8);
+
+    // True when `data` starts with the magic and the version of `expected`
+    inline bool has_magic(const char* data, size_t size, const Header& expected) {
+        return size >= sizeof(Header)
+            && std::memcmp(data, expected.magic, sizeof(Header::magic)) == 0
+            && static_cast<uint8_t>(data[offsetof(Header, version)]) == expected.version;
+    }
+}
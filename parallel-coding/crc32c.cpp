@@ -0,0 +1,115 @@
+#include "crc32c.h"
+#include "check.h"
+
+#include <array>
+#include <string>
+#include <cstring>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace {
+    constexpr uint32_t POLYNOMIAL = 0x82f63b78; // reversed 0x1edc6f41
+
+    // tables[k][b] is the CRC of byte b followed by k zero bytes
+    constexpr std::array<std::array<uint32_t, 0x100>, 8> make_tables() {
+        std::array<std::array<uint32_t, 0x100>, 8> tables{};
+        for (uint32_t b = 0; b < 0x100; ++b) {
+            uint32_t crc = b;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (crc & 1u ? POLYNOMIAL : 0);
+            }
+            tables[0][b] = crc;
+        }
+        for (int k = 1; k < 8; ++k) {
+            for (uint32_t b = 0; b < 0x100; ++b) {
+                tables[k][b] = (tables[k - 1][b] >> 8) ^ tables[0][tables[k - 1][b] & 0xff];
+            }
+        }
+        return tables;
+    }
+    constexpr auto TABLES = make_tables();
+
+    uint32_t extend_portable(uint32_t crc, const char* data, size_t size) {
+        auto bytes = reinterpret_cast<const unsigned char*>(data);
+        for (; size >= 8; size -= 8, bytes += 8) {
+            uint32_t low;
+            uint32_t high;
+            std::memcpy(&low, bytes, sizeof(low));
+            std::memcpy(&high, bytes + 4, sizeof(high));
+            low ^= crc;
+            crc = TABLES[7][low & 0xff] ^ TABLES[6][(low >> 8) & 0xff]
+                ^ TABLES[5][(low >> 16) & 0xff] ^ TABLES[4][low >> 24]
+                ^ TABLES[3][high & 0xff] ^ TABLES[2][(high >> 8) & 0xff]
+                ^ TABLES[1][(high >> 16) & 0xff] ^ TABLES[0][high >> 24];
+        }
+        for (; size > 0; --size, ++bytes) {
+            crc = (crc >> 8) ^ TABLES[0][(crc ^ *bytes) & 0xff];
+        }
+        return crc;
+    }
+
+#if defined(__x86_64__)
+    __attribute__((target("sse4.2")))
+    uint32_t extend_sse42(uint32_t crc, const char* data, size_t size) {
+        uint64_t wide = crc;
+        for (; size >= 8; size -= 8, data += 8) {
+            uint64_t word;
+            std::memcpy(&word, data, sizeof(word));
+            wide = _mm_crc32_u64(wide, word);
+        }
+        crc = static_cast<uint32_t>(wide);
+        for (; size > 0; --size, ++data) {
+            crc = _mm_crc32_u8(crc, static_cast<unsigned char>(*data));
+        }
+        return crc;
+    }
+#endif
+
+    using Extend = uint32_t (*)(uint32_t, const char*, size_t);
+
+    Extend choose() {
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("sse4.2")) {
+            return extend_sse42;
+        }
+#endif
+        return extend_portable;
+    }
+}
+
+uint32_t crc32c::extend(uint32_t crc, const char* data, size_t size) {
+    static const Extend implementation = choose();
+    return ~implementation(~crc, data, size);
+}
+
+uint32_t crc32c::checksum(const char* data, size_t size) {
+    return extend(0, data, size);
+}
+
+void test_crc32c() {
+    // the check value of CRC-32C, from both implementations whichever one the CPU gets
+    CHECK(crc32c::checksum("123456789", 9) == 0xe3069283);
+    CHECK(~extend_portable(~0u, "123456789", 9) == 0xe3069283);
+    std::string data(100, '\0');
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i * 37 + 11);
+    }
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        CHECK(~extend_sse42(~0u, "123456789", 9) == 0xe3069283);
+        // every length and alignment through the 8-byte loop and the byte tail
+        for (size_t start = 0; start < 8; ++start) {
+            for (size_t size = 0; start + size <= data.size(); ++size) {
+                CHECK(extend_sse42(0x12345678, data.data() + start, size)
+                       == extend_portable(0x12345678, data.data() + start, size));
+            }
+        }
+    }
+#endif
+    // a checksum extended over the rest is the checksum of the whole
+    for (size_t split = 0; split <= data.size(); ++split) {
+        CHECK(crc32c::extend(crc32c::checksum(data.data(), split), data.data() + split, data.size() - split)
+               == crc32c::checksum(data.data(), data.size()));
+    }
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32C (Castagnoli) of block contents: the SSE4.2 instruction when the CPU has it, slicing-by-8 otherwise
+namespace crc32c {
+    // `crc` of the bytes before `data`, 0 at the start
+    uint32_t extend(uint32_t crc, const char* data, size_t size);
+    uint32_t checksum(const char* data, size_t size);
+}
+
+void test_crc32c();
@@ -0,0 +1,77 @@
+#include "generator.h"
+
+#include <cmath>
+#include <algorithm>
+
+// SplitMix64 finalizer over a Weyl sequence
+uint64_t generator::random_at(uint64_t seed, uint64_t counter) {
+    uint64_t z = seed + (counter + 1) * 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+generator::AliasTable generator::alias_table(const std::string& symbols, const std::vector<double>& weights) {
+    size_t n = symbols.size();
+    AliasTable table{symbols, std::vector<uint64_t>(n, 1ull << 32), std::vector<uint32_t>(n)};
+    double total = 0;
+    for (double weight : weights) {
+        total += weight;
+    }
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small;
+    std::vector<uint32_t> large;
+    for (uint32_t i = 0; i < n; ++i) {
+        scaled[i] = weights[i] * static_cast<double>(n) / total;
+        (scaled[i] < 1 ? small : large).push_back(i);
+        table.alias[i] = i;
+    }
+    while (!small.empty() && !large.empty()) {
+        uint32_t less = small.back();
+        small.pop_back();
+        uint32_t more = large.back();
+        table.threshold[less] = static_cast<uint64_t>(scaled[less] * 4294967296.0);
+        table.alias[less] = more;
+        scaled[more] -= 1 - scaled[less];
+        if (scaled[more] < 1) {
+            large.pop_back();
+            small.push_back(more);
+        }
+    }
+    // leftovers are 1 up to rounding
+    return table;
+}
+
+std::vector<double> generator::zipf_weights(size_t n, double exponent) {
+    std::vector<double> weights(n);
+    for (size_t k = 0; k < n; ++k) {
+        weights[k] = std::pow(static_cast<double>(k + 1), -exponent);
+    }
+    return weights;
+}
+
+static char sample(const generator::AliasTable& table, uint64_t random) {
+    auto column = static_cast<uint32_t>(((random & 0xffffffffull) * table.symbols.size()) >> 32);
+    return (random >> 32) < table.threshold[column] ? table.symbols[column] : table.symbols[table.alias[column]];
+}
+
+void generator::generate_chunk(const AliasTable& table, uint64_t seed, uint64_t chunk, double run_length,
+                               char* out, size_t size) {
+    uint64_t counter = chunk << 32;
+    if (run_length <= 1) {
+        for (size_t i = 0; i < size; ++i) {
+            out[i] = sample(table, random_at(seed, counter++));
+        }
+        return;
+    }
+    double log_continue = std::log1p(-1 / run_length);
+    for (size_t i = 0; i < size; ) {
+        char symbol = sample(table, random_at(seed, counter++));
+        // uniform in (0, 1]
+        double u = static_cast<double>((random_at(seed, counter++) >> 11) + 1) * 0x1p-53;
+        auto length = static_cast<size_t>(std::log(u) / log_continue) + 1;
+        length = std::min(length, size - i);
+        std::fill(out + i, out + i + length, symbol);
+        i += length;
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace generator {
+    // Bytes generated from one counter range; chunk k always holds the same bytes,
+    // whichever rank generates it
+    constexpr size_t CHUNK_SIZE = 1 << 16;
+
+    // Counter-based: the same (seed, counter) always gives the same number
+    uint64_t random_at(uint64_t seed, uint64_t counter);
+
+    // Walker's alias method, one random number per sample
+    struct AliasTable {
+        std::string symbols;
+        std::vector<uint64_t> threshold; // of the high 32 bits, 1 << 32 never takes the alias
+        std::vector<uint32_t> alias;
+    };
+    AliasTable alias_table(const std::string& symbols, const std::vector<double>& weights);
+    std::vector<double> zipf_weights(size_t n, double exponent); // 0 is uniform
+
+    // Runs of one symbol have geometric lengths with mean `run_length`, 1 gives independent symbols.
+    // Runs do not continue across chunks.
+    void generate_chunk(const AliasTable& table, uint64_t seed, uint64_t chunk, double run_length,
+                        char* out, size_t size);
+}
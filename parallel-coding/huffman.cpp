@@ -3,16 +3,32 @@
 //
 
 #include "huffman.h"
+#include "crc32c.h"
+#include "check.h"
 
 #include <sstream>
 #include <vector>
 #include <algorithm>
 #include <cassert>
 #include <numeric>
+#include <cstring>
+#include <queue>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace huffman;
 
 AprioriStats coding_price(const std::vector<Code>& codes, const std::vector<freq_t>& frequencies);
+
+// code bits in stream order, the first one highest
+static uint32_t reversed(Code code) {
+    uint32_t result = 0;
+    for (unsigned i = 0; i < code.length; ++i) {
+        result = (result << 1) | ((code.value >> i) & 1u);
+    }
+    return result;
+}
 EncodingStats encode(std::istream& is, std::ostream& os, const AlphabetCoding& coding, Code longest, size_t body_size_bits);
 
 struct Huffman {
@@ -51,20 +67,47 @@ private:
     }
 };
 
+// Two passes over the stream a buffer at a time, the histogram and then the codes of every PART_SIZE bytes,
+// each part with its own padding as decode_body reads them
 std::pair<AprioriStats, EncodingStats> huffman::encode(std::istream& is, std::ostream& os) {
     FrequencyMap freqs = huffman::frequencies(is);
     auto [coding, apriori, longest] = huffman::coding(freqs);
     is.clear();
     is.seekg(0, std::ios::beg); // rewind
-    return {apriori, my_encode(is, os, coding, longest, apriori.body_size_bits)};
+    encode_head(os, coding);
+    auto table = code_table(coding);
+    EncodingStats result{sizeof(size_t) + coding.size() * (sizeof(char) + sizeof(Code)), 0};
+    std::string part(PART_SIZE, '\0');
+    std::string output;
+    while (is.read(part.data(), PART_SIZE) || is.gcount() > 0) {
+        auto size = static_cast<size_t>(is.gcount());
+        size_t body_size_bits = 0;
+        for (size_t i = 0; i < size; ++i) {
+            body_size_bits += table[static_cast<unsigned char>(part[i])].length;
+        }
+        output.clear();
+        auto stats = encode_bits(part.data(), size, output, table, longest, body_size_bits);
+        os.write(output.data(), static_cast<std::streamsize>(output.size()));
+        result.output_size += stats.output_size;
+        result.input_size += stats.input_size;
+    }
+    return {apriori, result};
 }
 
+AlphabetDecoding decode_entries(std::istream& is, size_t alphabet_size);
+
 AlphabetDecoding huffman::decode_head(std::istream& is) {
     size_t alphabet_size;
     if (!is.read(reinterpret_cast<char*>(&alphabet_size), sizeof(size_t))) {
         return {};
     }
+    return decode_entries(is, alphabet_size);
+}
+
+// A code of no bits or of more than L bits leaves the decoding empty, so nothing decodes with it
+AlphabetDecoding decode_entries(std::istream& is, size_t alphabet_size) {
     AlphabetDecoding decoding;
+    bool valid = true;
     for (; alphabet_size > 0;--alphabet_size) {
         char ch;
         Code c{};
@@ -74,72 +117,543 @@ AlphabetDecoding huffman::decode_head(std::istream& is) {
         if (!is.read(reinterpret_cast<char*>(&c), sizeof(Code))) {
             return {};
         }
+        valid = valid && c.length != 0 && c.length <= L;
         decoding.emplace(c, ch);
     }
-    return decoding;
+    return valid ? decoding : AlphabetDecoding{};
 }
 
+// Reads the body WINDOW_SIZE bytes at a time, a code cut by the end of the window is decoded after the refill
 void huffman::decode_body(const AlphabetDecoding& decoding, std::istream& is, std::ostream& os) {
-    Code currentCode;
-    char input_buffer;
-    size_t output_index = 0;
-    int i;
-    int padding_size;
-    if (!is.get(input_buffer)) {
-        return;
-    }
-    do {
-        if (output_index == 0) {
-            Code padding{};
-            for (i = 0; i < 2; ++i, input_buffer <<= 1) {
-                if (input_buffer < 0) {
-                    padding = padding.with_one();
-                } else {
-                    padding = padding.with_zero();
+    auto table = decoding_table(decoding);
+    std::string window(WINDOW_SIZE, '\0');
+    size_t filled = 0;
+    bool end = false;
+    auto refill = [&](size_t consumed) {
+        std::memmove(window.data(), window.data() + consumed, filled - consumed);
+        filled -= consumed;
+        if (!end) {
+            is.read(window.data() + filled, static_cast<std::streamsize>(window.size() - filled));
+            filled += is.gcount();
+            end = !is;
+        }
+    };
+    std::string output(WINDOW_SIZE, '\0');
+    size_t written = 0;
+    refill(0);
+    // every part starts at a byte boundary with its own padding prefix,
+    // but only the padding of the last byte of the stream is skipped
+    size_t bit = 0;
+    size_t produced = PART_SIZE; // of the current part
+    size_t padding_size = 0;
+    for (;;) {
+        if (produced == PART_SIZE) {
+            bit = (bit + 7) / 8 * 8;
+            if (bit + 2 > filled * 8) {
+                if (end) {
+                    break;
                 }
+                refill(bit / 8);
+                bit = 0;
+                continue;
             }
-            padding_size = padding.value == 0 ? 0 : 4 + padding.value;
-            currentCode = {};
-        }
-        int i_max = is.peek() != EOF ? 8 : 8 - padding_size;
-        for (; i < i_max; ++i, input_buffer <<= 1) {
-            if (input_buffer < 0) {
-                currentCode = currentCode.with_one();
-            } else {
-                currentCode = currentCode.with_zero();
+            if (output.size() - written < PART_SIZE) {
+                os.write(output.data(), static_cast<std::streamsize>(written));
+                written = 0;
             }
-            auto it = decoding.find(currentCode);
-            if (it == decoding.end()) {
-                continue;
+            unsigned prefix = static_cast<unsigned char>(window[bit / 8]) >> 6;
+            unsigned padding = (prefix >> 1) | ((prefix & 1u) << 1);
+            padding_size = padding == 0 ? 0 : 4 + padding;
+            bit += 2;
+            produced = 0;
+        }
+        size_t limit = filled * 8;
+        if (end) {
+            limit -= std::min(limit, padding_size);
+        }
+        size_t got = decode_bits(table, window.data(), bit, limit, PART_SIZE - produced, output.data() + written);
+        produced += got;
+        written += got;
+        if (produced == PART_SIZE) {
+            continue;
+        }
+        // the stream ends, or a whole window holds no complete code
+        if (end || (got == 0 && bit / 8 == 0)) {
+            break;
+        }
+        refill(bit / 8);
+        bit %= 8;
+    }
+    os.write(output.data(), static_cast<std::streamsize>(written));
+}
+
+// next 64 bits of the stream starting at `bit`, the first one in the highest position
+static uint64_t peek_bits(const char* data, size_t size, size_t bit) {
+    size_t byte = bit / 8;
+    uint64_t window = 0;
+    if (byte + sizeof(window) <= size) {
+        std::memcpy(&window, data + byte, sizeof(window));
+        window = __builtin_bswap64(window);
+    } else {
+        for (size_t i = 0; i < sizeof(window); ++i) {
+            window = (window << 8) | (byte + i < size ? static_cast<unsigned char>(data[byte + i]) : 0u);
+        }
+    }
+    return window << (bit % 8);
+}
+
+DecodingTable huffman::decoding_table(const AlphabetDecoding& decoding) {
+    DecodingTable table(1u << DECODE_BITS, DecodeEntry{});
+    std::map<uint32_t, std::vector<std::pair<Code, char>>> long_codes; // by first-level prefix
+    for (auto [code, symbol]: decoding) {
+        if (code.length > DECODE_BITS) {
+            long_codes[reversed(code) >> (code.length - DECODE_BITS)].emplace_back(code, symbol);
+            continue;
+        }
+        unsigned free = DECODE_BITS - code.length;
+        uint32_t first = reversed(code) << free;
+        std::fill_n(table.begin() + first, 1u << free, DecodeEntry{{symbol, '\0'}, 1, code.length, code.length, 0});
+    }
+    for (auto& [prefix, codes]: long_codes) {
+        unsigned sub_bits = 0;
+        for (auto [code, _]: codes) {
+            sub_bits = std::max(sub_bits, code.length - DECODE_BITS);
+        }
+        auto link = static_cast<uint32_t>(table.size());
+        table[prefix] = {{}, 0, 0, static_cast<uint8_t>(sub_bits), link};
+        table.resize(link + (1u << sub_bits));
+        for (auto [code, symbol]: codes) {
+            unsigned rest = code.length - DECODE_BITS;
+            unsigned free = sub_bits - rest;
+            uint32_t first = (reversed(code) & ((1u << rest) - 1)) << free;
+            std::fill_n(table.begin() + link + first, 1u << free, DecodeEntry{{symbol, '\0'}, 1, code.length, code.length, 0});
+        }
+    }
+    // pack a second symbol into first-level entries whenever its code fits into the same window
+    constexpr uint32_t mask = (1u << DECODE_BITS) - 1;
+    for (uint32_t i = 0; i <= mask; ++i) {
+        DecodeEntry& entry = table[i];
+        if (entry.count != 1) {
+            continue;
+        }
+        const DecodeEntry& next = table[(i << entry.first_length) & mask];
+        if (next.count == 0 || next.first_length > DECODE_BITS - entry.first_length) {
+            continue;
+        }
+        entry.symbols[1] = next.symbols[0];
+        entry.count = 2;
+        entry.length = entry.first_length + next.first_length;
+    }
+    return table;
+}
+
+size_t huffman::decode_bits(const DecodingTable& table, const char* data, size_t& bit, size_t bit_limit, size_t symbols, char* out) {
+    size_t size = (bit_limit + 7) / 8;
+    size_t produced = 0;
+    while (produced < symbols) {
+        uint64_t window = peek_bits(data, size, bit);
+        DecodeEntry entry = table[window >> (64 - DECODE_BITS)];
+        if (entry.count == 0) {
+            if (entry.length == 0) {
+                break; // not a prefix of any code
             }
-            os << it->second;
-            currentCode = {};
-            output_index++;
-            output_index %= PART_SIZE;
-            if (output_index == 0) {
+            entry = table[entry.link + ((window << DECODE_BITS) >> (64 - entry.length))];
+            if (entry.count == 0) {
+                break;
+            }
+        }
+        if (entry.count == 2 && produced + 2 <= symbols && bit + entry.length <= bit_limit) {
+            out[produced++] = entry.symbols[0];
+            out[produced++] = entry.symbols[1];
+            bit += entry.length;
+            continue;
+        }
+        if (bit + entry.first_length > bit_limit) {
+            break;
+        }
+        out[produced++] = entry.symbols[0];
+        bit += entry.first_length;
+    }
+    return produced;
+}
+
+// False on a malformed table or block, the blocks before it are written
+bool huffman::decode(std::istream& is, std::ostream& os) {
+    size_t alphabet_size;
+    if (!is.read(reinterpret_cast<char*>(&alphabet_size), sizeof(size_t))) {
+        return true;
+    }
+    Header header{};
+    std::memcpy(&header, &alphabet_size, sizeof(Header));
+    if (!container::has_magic(reinterpret_cast<const char*>(&header), sizeof(header), CONTAINER)) {
+        auto decoding = decode_entries(is, alphabet_size);
+        if (decoding.empty()) {
+            return alphabet_size == 0;
+        }
+        decode_body(decoding, is, os);
+        return true;
+    }
+    auto decoding = decode_table(is, header);
+    if (!is) {
+        return false;
+    }
+    auto table = decoding_table(decoding);
+    BlockHeader block{};
+    while (is.read(reinterpret_cast<char*>(&block), sizeof(BlockHeader)) && block.length != 0) {
+        bool intact = header.flags & LOCAL_TABLES ? decode_local_block(table, is, os, block, header.flags)
+                                                   : decode_block(table, is, os, block, header.flags);
+        if (!intact) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Bits of a block body after its table, one stream or STREAM_COUNT of them
+static size_t decode_payload(const DecodingTable& table, const char* data, size_t size, size_t symbols, char* out, bool streams) {
+    if (streams) {
+        return decode_streams(table, data, size, symbols, out);
+    }
+    size_t bit = 2; // the block length already tells where the padding starts
+    return decode_bits(table, data, bit, size * 8, symbols, out);
+}
+
+static EncodingStats encode_payload(const char* data, size_t size, std::string& out, const CodeTable& table, Code longest,
+                                    size_t body_size_bits, bool streams) {
+    return streams ? encode_streams(data, size, out, table, longest) : encode_bits(data, size, out, table, longest, body_size_bits);
+}
+
+// Bytes of the checksum at the start of a block body
+static size_t checksum_size(uint8_t flags) {
+    return flags & CHECKSUMS ? sizeof(uint32_t) : 0;
+}
+
+static void put_checksum(std::string& out, const char* data, size_t size, uint8_t flags) {
+    if (flags & CHECKSUMS) {
+        uint32_t crc = crc32c::checksum(data, size);
+        out.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+    }
+}
+
+// False when the block is cut short or its bits do not decode to all of its symbols
+bool huffman::decode_block(const DecodingTable& table, std::istream& is, std::ostream& os, BlockHeader block, uint8_t flags) {
+    std::string body(block.length, '\0');
+    size_t start = checksum_size(flags);
+    if (!is.read(body.data(), block.length) || body.size() < start) {
+        return false;
+    }
+    std::string output(block.symbols, '\0');
+    size_t produced = decode_payload(table, body.data() + start, body.size() - start, block.symbols, output.data(),
+                                     flags & STREAMS);
+    os.write(output.data(), static_cast<std::streamsize>(produced));
+    return produced == block.symbols;
+}
+
+EncodingStats huffman::encode_block(const char* data, size_t size, std::string& out, const CodeTable& table, Code longest, uint8_t flags) {
+    size_t body_size_bits = 0;
+    for (size_t i = 0; i < size; ++i) {
+        body_size_bits += table[static_cast<unsigned char>(data[i])].length;
+    }
+    size_t header = out.size();
+    out.resize(header + sizeof(BlockHeader));
+    put_checksum(out, data, size, flags);
+    auto stats = encode_payload(data, size, out, table, longest, body_size_bits, flags & STREAMS);
+    stats.output_size = out.size() - header - sizeof(BlockHeader);
+    BlockHeader block{static_cast<uint32_t>(stats.output_size), static_cast<uint32_t>(stats.input_size)};
+    std::memcpy(out.data() + header, &block, sizeof(BlockHeader));
+    stats.output_size += sizeof(BlockHeader);
+    return stats;
+}
+
+// Encodes with the block's own canonical table unless `shared` is at least as cheap with that table included
+EncodingStats huffman::encode_local_block(const char* data, size_t size, std::string& out, const CodeTable* shared, Code longest, uint8_t flags) {
+    freq_t counts[0x100] = {};
+    histogram(data, size, counts);
+    size_t shared_bits = SIZE_MAX;
+    if (shared != nullptr) {
+        shared_bits = 0;
+        for (unsigned c = 0; c < 0x100; ++c) {
+            if (counts[c] != 0 && (*shared)[c].length == 0) {
+                shared_bits = SIZE_MAX;
                 break;
             }
+            shared_bits += counts[c] * (*shared)[c].length;
+        }
+    }
+    auto local = canonical_coding(frequency_map(counts));
+    std::ostringstream lengths;
+    encode_lengths(lengths, local.coding);
+    size_t local_bits = lengths.tellp() * 8 + local.apriori.body_size_bits;
+
+    size_t header = out.size();
+    out.resize(header + sizeof(BlockHeader));
+    put_checksum(out, data, size, flags);
+    EncodingStats stats{};
+    bool streams = flags & STREAMS;
+    if (shared_bits <= local_bits) {
+        out.push_back(static_cast<char>(SHARED_TABLE));
+        stats = encode_payload(data, size, out, *shared, longest, shared_bits, streams);
+    } else {
+        out.push_back(static_cast<char>(LOCAL_TABLE));
+        out += lengths.str();
+        stats = encode_payload(data, size, out, code_table(local.coding), local.longest, local.apriori.body_size_bits, streams);
+    }
+    stats.output_size = out.size() - header - sizeof(BlockHeader);
+    BlockHeader block{static_cast<uint32_t>(stats.output_size), static_cast<uint32_t>(stats.input_size)};
+    std::memcpy(out.data() + header, &block, sizeof(BlockHeader));
+    stats.output_size += sizeof(BlockHeader);
+    return stats;
+}
+
+// Same as decode_block, a malformed local table also fails the block
+bool huffman::decode_local_block(const DecodingTable& shared, std::istream& is, std::ostream& os, BlockHeader block, uint8_t flags) {
+    std::string body(block.length, '\0');
+    size_t start = checksum_size(flags);
+    if (!is.read(body.data(), block.length) || body.size() <= start) {
+        return false;
+    }
+    char kind = body[start++];
+    DecodingTable local;
+    if (kind == LOCAL_TABLE) {
+        std::istringstream lengths{body.substr(start)};
+        local = decoding_table(decode_lengths(lengths));
+        if (!lengths) {
+            return false;
+        }
+        start += lengths.tellg();
+    } else if (kind != SHARED_TABLE) {
+        return false;
+    }
+    const DecodingTable& table = kind == LOCAL_TABLE ? local : shared;
+    std::string output(block.symbols, '\0');
+    size_t produced = decode_payload(table, body.data() + start, body.size() - start, block.symbols, output.data(),
+                                     flags & STREAMS);
+    os.write(output.data(), static_cast<std::streamsize>(produced));
+    return produced == block.symbols;
+}
+
+// Decodes a block body in memory and compares the CRC32C of its symbols with the stored one
+bool huffman::verify_block(const DecodingTable& shared, const char* body, BlockHeader block, uint8_t flags) {
+    uint32_t stored;
+    if (!(flags & CHECKSUMS) || block.length < sizeof(stored)) {
+        return false;
+    }
+    std::memcpy(&stored, body, sizeof(stored));
+    std::istringstream is{std::string(body, block.length)};
+    std::ostringstream os;
+    bool decoded = flags & LOCAL_TABLES ? decode_local_block(shared, is, os, block, flags)
+                                        : decode_block(shared, is, os, block, flags);
+    auto output = os.str();
+    return decoded && crc32c::checksum(output.data(), output.size()) == stored;
+}
+
+// Symbols of stream k are [k * quarter, (k + 1) * quarter) of the block, the last one may be shorter
+static size_t stream_symbols(size_t size, int k) {
+    size_t quarter = (size + STREAM_COUNT - 1) / STREAM_COUNT;
+    return std::min(quarter, size - std::min(size, k * quarter));
+}
+
+EncodingStats huffman::encode_streams(const char* data, size_t size, std::string& out, const CodeTable& table, Code longest) {
+    size_t start = out.size();
+    JumpTable jumps{};
+    out.resize(start + sizeof(jumps));
+    size_t first = 0;
+    for (int k = 0; k < STREAM_COUNT; first += stream_symbols(size, k), ++k) {
+        size_t symbols = stream_symbols(size, k);
+        size_t body_size_bits = 0;
+        for (size_t i = first; i < first + symbols; ++i) {
+            body_size_bits += table[static_cast<unsigned char>(data[i])].length;
+        }
+        auto stats = encode_bits(data + first, symbols, out, table, longest, body_size_bits);
+        if (k < STREAM_COUNT - 1) {
+            jumps[k] = static_cast<uint32_t>(stats.output_size);
+        }
+    }
+    std::memcpy(out.data() + start, jumps.data(), sizeof(jumps));
+    return {out.size() - start, size};
+}
+
+// Decodes the streams in lockstep while all of them are far from their ends, then each one to its end
+size_t huffman::decode_streams(const DecodingTable& table, const char* data, size_t size, size_t symbols, char* out) {
+    JumpTable jumps{};
+    if (size < sizeof(jumps)) {
+        return 0;
+    }
+    std::memcpy(jumps.data(), data, sizeof(jumps));
+    struct Stream {
+        const char* data;
+        size_t size;
+        size_t bit;
+        char* out;
+        char* end; // of the symbols of the stream
+    };
+    Stream streams[STREAM_COUNT];
+    size_t position = sizeof(jumps);
+    for (int k = 0; k < STREAM_COUNT; ++k) {
+        size_t length = k < STREAM_COUNT - 1 ? jumps[k] : size - std::min(size, position);
+        if (length > size - std::min(size, position)) {
+            return 0;
+        }
+        size_t first = std::min(symbols, k * stream_symbols(symbols, 0));
+        streams[k] = {data + position, length, 2, out + first, out + first + stream_symbols(symbols, k)};
+        position += length;
+    }
+    // a stream with two symbols left cannot decode its padding, a code of at most L bits fits into the window;
+    // a round takes at most two symbols and L bits of every stream, so this many rounds need no checks
+    auto rounds = [](const Stream& stream) {
+        size_t window_end = stream.size < sizeof(uint64_t) ? 0 : (stream.size - sizeof(uint64_t)) * 8;
+        size_t left = stream.end - stream.out;
+        if (left < 2 || stream.bit > window_end) {
+            return size_t{0};
+        }
+        return std::min(left / 2, (window_end - stream.bit) / L + 1);
+    };
+    const DecodeEntry* entries = table.data(); // the output stores would reload it from the vector
+    for (size_t round_count; (round_count = std::min({rounds(streams[0]), rounds(streams[1]), rounds(streams[2]),
+                                                      rounds(streams[3])})) > 0; ) {
+        for (; round_count > 0; --round_count) {
+            for (auto& stream : streams) {
+                uint64_t window;
+                std::memcpy(&window, stream.data + stream.bit / 8, sizeof(window));
+                window = __builtin_bswap64(window) << (stream.bit % 8);
+                DecodeEntry entry = entries[window >> (64 - DECODE_BITS)];
+                if (entry.count == 0) {
+                    if (entry.length == 0) {
+                        return 0;
+                    }
+                    entry = entries[entry.link + ((window << DECODE_BITS) >> (64 - entry.length))];
+                    if (entry.count == 0) {
+                        return 0;
+                    }
+                }
+                stream.out[0] = entry.symbols[0];
+                stream.out[1] = entry.symbols[1];
+                stream.out += entry.count;
+                stream.bit += entry.length;
+            }
+        }
+    }
+    size_t produced = 0;
+    for (auto& stream : streams) {
+        size_t done = stream.out - out - produced;
+        size_t left = stream.end - stream.out;
+        size_t tail = decode_bits(table, stream.data, stream.bit, stream.size * 8, left, stream.out);
+        if (tail != left) {
+            return produced + done + tail;
         }
-        i = 0;
-    } while(is.get(input_buffer));
+        produced += done + tail;
+    }
+    return produced;
 }
 
-void huffman::decode(std::istream& is, std::ostream& os) {
-    auto decoding = decode_head(is);
-    if (decoding.empty()) {
-        return;
+Index huffman::index_blocks(const std::string& blocks, uint64_t offset) {
+    Index index;
+    for (size_t position = 0; position + sizeof(BlockHeader) <= blocks.size(); ) {
+        BlockIndex entry{offset + position, {}};
+        std::memcpy(&entry.block, blocks.data() + position, sizeof(BlockHeader));
+        if (entry.block.length == 0) {
+            break;
+        }
+        index.push_back(entry);
+        position += sizeof(BlockHeader) + entry.block.length;
     }
-    decode_body(decoding, is, os);
+    return index;
+}
+
+void huffman::encode_index(std::ostream& os, const Index& index) {
+    BlockHeader end{};
+    os.write(reinterpret_cast<char*>(&end), sizeof(BlockHeader));
+    os.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(BlockIndex));
+    uint64_t blocks = index.size();
+    os.write(reinterpret_cast<char*>(&blocks), sizeof(blocks));
+}
+
+Index huffman::decode_index(std::string_view container) {
+    uint64_t blocks;
+    if (container.size() < sizeof(Header) + sizeof(blocks)) {
+        return {};
+    }
+    std::memcpy(&blocks, container.data() + container.size() - sizeof(blocks), sizeof(blocks));
+    if (blocks > (container.size() - sizeof(blocks)) / sizeof(BlockIndex)) {
+        return {};
+    }
+    Index index(blocks);
+    std::memcpy(index.data(), container.data() + container.size() - sizeof(blocks) - blocks * sizeof(BlockIndex),
+                blocks * sizeof(BlockIndex));
+    return index;
 }
 
 FrequencyMap huffman::frequencies(std::istream &is) {
+    std::array<freq_t, 0x100> counts{};
+    std::vector<char> buffer(1 << 16);
+    while (is.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) || is.gcount() > 0) {
+        histogram(buffer.data(), is.gcount(), counts.data());
+    }
+    return frequency_map(counts.data());
+}
+
+FrequencyMap huffman::frequency_map(const freq_t* counts) {
     FrequencyMap result{};
-    for (char c; is.get(c); ) {
-        ++result[c];
+    for (int i = 0; i < 0x100; ++i) {
+        if (counts[i] != 0) {
+            result[static_cast<char>(i)] = counts[i];
+        }
     }
     return result;
 }
 
+// Adds the 32-bit counters of all tables to the 64-bit ones
+static void reduce_tables(const uint32_t (*tables)[0x100], size_t table_count, freq_t* counts) {
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < 0x100; i += 4) {
+        __m128i sum = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables[0] + i));
+        for (size_t t = 1; t < table_count; ++t) {
+            sum = _mm_add_epi32(sum, _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables[t] + i)));
+        }
+        auto* low = reinterpret_cast<__m128i*>(counts + i);
+        auto* high = reinterpret_cast<__m128i*>(counts + i + 2);
+        _mm_storeu_si128(low, _mm_add_epi64(_mm_loadu_si128(low), _mm_unpacklo_epi32(sum, zero)));
+        _mm_storeu_si128(high, _mm_add_epi64(_mm_loadu_si128(high), _mm_unpackhi_epi32(sum, zero)));
+    }
+#else
+    for (int i = 0; i < 0x100; ++i) {
+        for (size_t t = 0; t < table_count; ++t) {
+            counts[i] += tables[t][i];
+        }
+    }
+#endif
+}
+
+// Interleaved counter tables break the store-to-load dependency on runs of equal bytes
+void huffman::histogram(const char* data, size_t size, freq_t* counts) {
+    constexpr size_t TABLES = 4;
+    constexpr size_t CHUNK = size_t{1} << 30; // keeps the sum of the 32-bit counters from overflowing
+    alignas(16) uint32_t tables[TABLES][0x100];
+    auto bytes = reinterpret_cast<const unsigned char*>(data);
+    for (size_t start = 0; start < size; start += CHUNK) {
+        std::memset(tables, 0, sizeof(tables));
+        size_t end = std::min(size, start + CHUNK);
+        size_t i = start;
+        for (; i + 8 <= end; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, bytes + i, sizeof(word));
+            tables[0][word & 0xff]++;
+            tables[1][(word >> 8) & 0xff]++;
+            tables[2][(word >> 16) & 0xff]++;
+            tables[3][(word >> 24) & 0xff]++;
+            tables[0][(word >> 32) & 0xff]++;
+            tables[1][(word >> 40) & 0xff]++;
+            tables[2][(word >> 48) & 0xff]++;
+            tables[3][word >> 56]++;
+        }
+        for (; i < end; ++i) {
+            tables[i % TABLES][bytes[i]]++;
+        }
+        reduce_tables(tables, TABLES, counts);
+    }
+}
+
 Coding huffman::coding(FrequencyMap freqs) {
     std::vector<char> alphabet;
     std::vector<freq_t> frequencies;
@@ -158,7 +672,20 @@ Coding huffman::coding(FrequencyMap freqs) {
                            return freqs[alpha];
                        });
     }
+    if (frequencies.size() < 2) {
+        // a single symbol still needs one bit per occurrence
+        std::vector<Code> codes(frequencies.size(), Code{}.with_zero());
+        AlphabetCoding encoding{};
+        if (!alphabet.empty()) {
+            encoding.emplace(alphabet.front(), codes.front());
+        }
+        return {encoding, coding_price(codes, frequencies), codes.empty() ? Code{} : codes.back()};
+    }
     auto codes = Huffman{frequencies}();
+    // skewed frequencies make codes longer than L, which no decoder accepts; canonical codes are limited to L
+    if (std::any_of(codes.begin(), codes.end(), [](Code code) { return code.length > L; })) {
+        return canonical_coding(freqs);
+    }
     AlphabetCoding encoding{};
     std::transform(alphabet.begin(), alphabet.end(), codes.begin(),
                    std::inserter(encoding, encoding.end()),
@@ -188,44 +715,70 @@ void huffman::encode_head(std::ostream &os, const AlphabetCoding &coding) {
 
 EncodingStats huffman::encode_body(std::istream &is, std::ostream &os, const AlphabetCoding &coding, Code longest, size_t body_size_bits) {
     size_t alphabet_size = coding.size();
-    EncodingStats result{};
-    result.output_size = sizeof(alphabet_size) + alphabet_size * (sizeof(char) + sizeof(Code));
-    size_t nbits = 0;
-    char current_byte = '\0';
-    auto bitout = [&](Code code) {
-        for (; code.length > 0; code.length--, code.value >>= 1) {
-            current_byte <<= 1;
-            current_byte |= code.value & 1;
-            nbits++;
-            if (nbits == 8) {
-                os.put(current_byte);
-                result.output_size++;
-                nbits = 0;
-                current_byte = '\0';
-            }
-        }
+    std::string input = (std::ostringstream{} << is.rdbuf()).str();
+    std::string output;
+    EncodingStats result = encode_bits(input.data(), input.size(), output, code_table(coding), longest, body_size_bits);
+    os.write(output.data(), static_cast<std::streamsize>(output.size()));
+    result.output_size += sizeof(alphabet_size) + alphabet_size * (sizeof(char) + sizeof(Code));
+    return result;
+}
+
+CodeTable huffman::code_table(const AlphabetCoding &coding) {
+    CodeTable table{};
+    for (auto [character, code]: coding) {
+        table[static_cast<unsigned char>(character)] = {reversed(code), code.length};
+    }
+    return table;
+}
+
+EncodingStats huffman::encode_bits(const char* data, size_t size, std::string& out, const CodeTable& table, Code longest, size_t body_size_bits) {
+    constexpr size_t CHUNK = 1024;
+    constexpr size_t CHUNK_BYTES = CHUNK * L / 8 + 2 * sizeof(uint32_t);
+    size_t start = out.size();
+    size_t position = start;
+    uint64_t accumulator = 0;
+    unsigned nbits = 0; // pending bits in the low end of the accumulator
+    auto flush_word = [&]() {
+        nbits -= 32;
+        uint32_t word = __builtin_bswap32(static_cast<uint32_t>(accumulator >> nbits));
+        std::memcpy(out.data() + position, &word, sizeof(word));
+        position += sizeof(word);
     };
+    out.resize(position + CHUNK_BYTES);
     // Size of padding at the end
+    // 5 to 7 bits of padding are 1 to 3 in the prefix, shorter ones have to be a prefix of the longest code
     unsigned int leftover = (body_size_bits + 2) % 8;
-    bitout({(leftover == 0 || longest.length > 8 - leftover) ? 0u : (8 - leftover) & 0x11, 2});
-    // Body
-    char input_buffer;
-    result.input_size = 0;
-    while (is.get(input_buffer)) {
-        bitout(coding.at(input_buffer));
-        result.input_size++;
+    unsigned int padding = (leftover == 0 || longest.length > 8 - leftover || 8 - leftover < 5) ? 0u : 8 - leftover - 4;
+    accumulator = ((padding & 1u) << 1) | ((padding >> 1) & 1u);
+    nbits = 2;
+    for (size_t i = 0; i < size; i += CHUNK) {
+        if (out.size() < position + CHUNK_BYTES) {
+            out.resize(position + CHUNK_BYTES);
+        }
+        size_t end = std::min(size, i + CHUNK);
+        for (size_t j = i; j < end; ++j) {
+            FlatCode code = table[static_cast<unsigned char>(data[j])];
+            accumulator = (accumulator << code.length) | code.bits;
+            nbits += code.length;
+            if (nbits >= 32) {
+                flush_word();
+            }
+        }
+    }
+    for (; nbits >= 8; nbits -= 8) {
+        out[position++] = static_cast<char>(accumulator >> (nbits - 8));
     }
     //Padding
     // use the trick introduced in https://cs.stackexchange.com/a/100163 by @evgeniy-berezovsky
     // and use two bits at the start to know padding size if it in range 5..7 bits
-    if (nbits == 0) {
-        return result;
+    if (nbits != 0) {
+        assert(leftover == nbits);
+        unsigned needed_length = 8 - nbits;
+        uint32_t tail = longest.length > needed_length ? reversed(longest) >> (longest.length - needed_length) : 0u;
+        out[position++] = static_cast<char>((accumulator << needed_length) | tail);
     }
-    assert(leftover == nbits);
-    auto needed_length = 8 - nbits;
-    bitout({longest.length > needed_length ? longest.value : 0u, static_cast<unsigned char>(8 - nbits)});
-    assert(nbits == 0);
-    return result;
+    out.resize(position);
+    return {position - start, size};
 }
 
 EncodingStats huffman::my_encode(std::istream &is, std::ostream &os, const AlphabetCoding &coding, Code longest, size_t body_size_bits) {
@@ -233,6 +786,142 @@ EncodingStats huffman::my_encode(std::istream &is, std::ostream &os, const Alpha
     return encode_body(is, os, coding, longest, body_size_bits);
 }
 
+// Code lengths from a binary heap of subtrees, limited to L bits by flattening the frequencies
+static std::vector<uint8_t> code_lengths(std::vector<freq_t> frequencies) {
+    size_t n = frequencies.size();
+    std::vector<uint8_t> lengths(n, 1);
+    if (n < 2) {
+        return lengths;
+    }
+    for (;;) {
+        using Node = std::pair<freq_t, size_t>;
+        std::priority_queue<Node, std::vector<Node>, std::greater<>> heap;
+        std::vector<size_t> parent(2 * n - 1, 0);
+        for (size_t i = 0; i < n; ++i) {
+            heap.emplace(frequencies[i], i);
+        }
+        for (size_t next = n; heap.size() > 1; ++next) {
+            auto [left_freq, left] = heap.top();
+            heap.pop();
+            auto [right_freq, right] = heap.top();
+            heap.pop();
+            parent[left] = parent[right] = next;
+            heap.emplace(left_freq + right_freq, next);
+        }
+        // parents are created after their children, so walk down from the root
+        std::vector<uint8_t> depth(2 * n - 1, 0);
+        for (size_t i = 2 * n - 2; i-- > 0; ) {
+            depth[i] = depth[parent[i]] + 1;
+        }
+        std::copy_n(depth.begin(), n, lengths.begin());
+        if (*std::max_element(lengths.begin(), lengths.end()) <= L) {
+            return lengths;
+        }
+        for (auto& freq: frequencies) {
+            freq = (freq >> 1) | 1;
+        }
+    }
+}
+
+Coding huffman::canonical_coding(const FrequencyMap& freqs) {
+    std::vector<char> alphabet;
+    std::vector<freq_t> frequencies;
+    for (auto [c, freq]: freqs) {
+        alphabet.push_back(c);
+        frequencies.push_back(freq);
+    }
+    auto lengths = code_lengths(frequencies);
+    std::vector<std::pair<char, uint8_t>> symbol_lengths;
+    AprioriStats apriori{0, 0};
+    for (size_t i = 0; i < alphabet.size(); ++i) {
+        symbol_lengths.emplace_back(alphabet[i], lengths[i]);
+        apriori.body_size_bits += lengths[i] * frequencies[i];
+        apriori.message_length += frequencies[i];
+    }
+    auto coding = canonical_codes(symbol_lengths);
+    Code longest{};
+    for (auto [_, code]: coding) {
+        if (code.length >= longest.length) {
+            longest = code;
+        }
+    }
+    return {coding, apriori, longest};
+}
+
+// Codes of the same length are consecutive numbers in symbol order, shorter lengths come first
+AlphabetCoding huffman::canonical_codes(const std::vector<std::pair<char, uint8_t>>& lengths) {
+    auto sorted = lengths;
+    std::sort(sorted.begin(), sorted.end(), [](auto left, auto right) {
+        return std::make_pair(left.second, static_cast<unsigned char>(left.first))
+             < std::make_pair(right.second, static_cast<unsigned char>(right.first));
+    });
+    AlphabetCoding coding;
+    uint32_t next = 0;
+    uint8_t length = sorted.empty() ? 0 : sorted.front().second;
+    for (auto [symbol, symbol_length]: sorted) {
+        next <<= symbol_length - length;
+        length = symbol_length;
+        Code code{};
+        for (unsigned i = 0; i < length; ++i) {
+            code = (next >> (length - 1 - i)) & 1u ? code.with_one() : code.with_zero();
+        }
+        coding.emplace(symbol, code);
+        next++;
+    }
+    return coding;
+}
+
+void huffman::encode_lengths(std::ostream &os, const AlphabetCoding &coding) {
+    auto alphabet_size = static_cast<uint16_t>(coding.size());
+    os.write(reinterpret_cast<char*>(&alphabet_size), sizeof(alphabet_size));
+    for (auto [character, code]: coding) {
+        os.put(character);
+        os.put(static_cast<char>(code.length));
+    }
+}
+
+// Lengths of 1 to L bits that leave no code a prefix of another (Kraft sum at most 1), otherwise
+// the table is still read to its end but the decoding is empty, so nothing decodes with it
+AlphabetDecoding huffman::decode_lengths(std::istream& is) {
+    uint16_t alphabet_size;
+    if (!is.read(reinterpret_cast<char*>(&alphabet_size), sizeof(alphabet_size))) {
+        return {};
+    }
+    std::vector<std::pair<char, uint8_t>> lengths;
+    uint64_t kraft = 0; // in units of 2^-L
+    bool valid = true;
+    for (; alphabet_size > 0; --alphabet_size) {
+        char symbol;
+        char length;
+        if (!is.get(symbol) || !is.get(length)) {
+            return {};
+        }
+        auto bits = static_cast<uint8_t>(length);
+        valid = valid && bits != 0 && bits <= L && (kraft += uint64_t{1} << (L - bits)) <= uint64_t{1} << L;
+        lengths.emplace_back(symbol, bits);
+    }
+    if (!valid) {
+        return {};
+    }
+    AlphabetDecoding decoding;
+    for (auto [symbol, code]: canonical_codes(lengths)) {
+        decoding.emplace(code, symbol);
+    }
+    return decoding;
+}
+
+void huffman::encode_table(std::ostream &os, const AlphabetCoding &coding, const Header& header) {
+    if (header.flags & CANONICAL) {
+        encode_lengths(os, coding);
+    } else {
+        encode_head(os, coding);
+    }
+}
+
+AlphabetDecoding huffman::decode_table(std::istream& is, const Header& header) {
+    return header.flags & CANONICAL ? decode_lengths(is) : decode_head(is);
+}
+
 void test_huffman() {
     std::vector<Code> expected{
             {0b00,     2},
@@ -244,7 +933,7 @@ void test_huffman() {
             {0b011010, 6},
             {0b111010, 6}};
     std::vector<Code> actual = Huffman{{31, 24, 17, 11, 9, 5, 2, 1}}();
-    assert(actual == expected);
+    CHECK(actual == expected);
 }
 
 void test_header() {
@@ -264,7 +953,146 @@ void test_header() {
     my_encode(raw, coded, table, table['h'], 30);
     coded.seekg(0, std::ios::beg);
     std::stringstream result;
-    huffman::decode(coded, result);
+    bool intact = huffman::decode(coded, result);
     std::string output = result.str();
-    assert(output == subject);
-}
\ No newline at end of file
+    CHECK(intact && output == subject);
+
+    // a stream of several parts, the last one short; the rare byte has a code longer than any padding
+    std::string text;
+    for (size_t i = 0; text.size() < 3 * PART_SIZE + 1234; ++i) {
+        text.push_back(static_cast<char>(i % 4999 == 1 ? '~' : 'a' + i * i % 23));
+    }
+    std::istringstream raw_text{text};
+    std::stringstream coded_text;
+    huffman::encode(raw_text, coded_text);
+    std::stringstream result_text;
+    intact = huffman::decode(coded_text, result_text);
+    CHECK(intact && result_text.str() == text);
+}
+
+void test_canonical() {
+    // codes of the same length count up in symbol order after the shorter ones
+    AlphabetCoding expected{
+            {'a', {0b01,  2}},
+            {'b', {0b0,   1}},
+            {'c', {0b011, 3}},
+            {'d', {0b111, 3}}};
+    CHECK(canonical_codes({{'a', 2}, {'b', 1}, {'c', 3}, {'d', 3}}) == expected);
+
+    std::string subject;
+    for (size_t i = 0; subject.size() < 50'000; ++i) {
+        subject.append(i % 13 + 1, static_cast<char>('a' + i % 7 * (i % 3)));
+    }
+    std::vector<freq_t> counts(0x100);
+    histogram(subject.data(), subject.size(), counts.data());
+    auto [coding, apriori, longest] = canonical_coding(frequency_map(counts.data()));
+    Header header = CONTAINER;
+    header.flags = CANONICAL;
+    std::stringstream table;
+    encode_table(table, coding, header);
+    auto decoding = decode_table(table, header);
+    CHECK(table && table.peek() == EOF && decoding.size() == coding.size());
+    for (uint8_t flags : {uint8_t{CANONICAL}, uint8_t{CANONICAL | STREAMS}, uint8_t{CANONICAL | CHECKSUMS}}) {
+        std::string block;
+        encode_block(subject.data(), subject.size(), block, code_table(coding), longest, flags);
+        BlockHeader head{};
+        std::memcpy(&head, block.data(), sizeof(head));
+        CHECK(head.symbols == subject.size() && head.length == block.size() - sizeof(head));
+        std::istringstream body{block.substr(sizeof(head))};
+        std::ostringstream output;
+        bool decoded = decode_block(decoding_table(decoding), body, output, head, flags);
+        CHECK(decoded && output.str() == subject);
+    }
+
+    // a length of 0 or above L and an oversubscribed table decode nothing, the table is still read to its end
+    for (const std::vector<std::pair<char, uint8_t>>& lengths : {
+            std::vector<std::pair<char, uint8_t>>{{'a', 1}, {'b', 0}},
+            std::vector<std::pair<char, uint8_t>>{{'a', 1}, {'b', L + 1}},
+            std::vector<std::pair<char, uint8_t>>{{'a', 1}, {'b', 1}, {'c', 2}}}) {
+        std::string invalid;
+        auto alphabet_size = static_cast<uint16_t>(lengths.size());
+        invalid.append(reinterpret_cast<const char*>(&alphabet_size), sizeof(alphabet_size));
+        for (auto [symbol, length] : lengths) {
+            invalid.push_back(symbol);
+            invalid.push_back(static_cast<char>(length));
+        }
+        std::istringstream is{invalid};
+        auto rejected = decode_lengths(is);
+        CHECK(rejected.empty() && is && is.peek() == EOF);
+    }
+}
+
+void test_local_tables() {
+    std::string common;
+    for (size_t i = 0; common.size() < 20'000; ++i) {
+        common.append(i % 5 + 1, static_cast<char>('a' + i % 6));
+    }
+    std::string other = std::string(5'000, 'z') + "zyzyx";
+    std::vector<freq_t> counts(0x100);
+    histogram(common.data(), common.size(), counts.data());
+    auto [coding, apriori, longest] = canonical_coding(frequency_map(counts.data()));
+    auto shared = code_table(coding);
+    AlphabetDecoding decoding;
+    for (auto [symbol, code] : coding) {
+        decoding.emplace(code, symbol);
+    }
+    auto shared_decoding = decoding_table(decoding);
+    // the block of the shared statistics uses the shared table, a block with symbols it lacks carries its own,
+    // so does every block without a shared table
+    for (uint8_t flags : {uint8_t{LOCAL_TABLES}, uint8_t{LOCAL_TABLES | STREAMS}, uint8_t{LOCAL_TABLES | CHECKSUMS}}) {
+        for (auto [subject, table, kind] : {std::make_tuple(&common, &shared, SHARED_TABLE),
+                                            std::make_tuple(&other, &shared, LOCAL_TABLE),
+                                            std::make_tuple(&common, static_cast<CodeTable*>(nullptr), LOCAL_TABLE)}) {
+            std::string block;
+            encode_local_block(subject->data(), subject->size(), block, table, longest, flags);
+            BlockHeader head{};
+            std::memcpy(&head, block.data(), sizeof(head));
+            CHECK(block[sizeof(head) + checksum_size(flags)] == static_cast<char>(kind));
+            std::istringstream body{block.substr(sizeof(head))};
+            std::ostringstream output;
+            bool decoded = decode_local_block(shared_decoding, body, output, head, flags);
+            CHECK(decoded && output.str() == *subject);
+            CHECK(!(flags & CHECKSUMS) || verify_block(shared_decoding, block.data() + sizeof(head), head, flags));
+        }
+    }
+    // a local table with a zero length fails its block
+    std::string block;
+    encode_local_block(other.data(), other.size(), block, nullptr, longest, LOCAL_TABLES);
+    BlockHeader head{};
+    std::memcpy(&head, block.data(), sizeof(head));
+    block[sizeof(head) + 1 + sizeof(uint16_t) + 1] = 0;
+    std::istringstream body{block.substr(sizeof(head))};
+    std::ostringstream output;
+    bool decoded = decode_local_block(shared_decoding, body, output, head, LOCAL_TABLES);
+    CHECK(!decoded);
+}
+
+void test_long_codes() {
+    // Fibonacci frequencies make a Huffman tree as deep as the alphabet is large
+    std::string subject;
+    freq_t previous = 1;
+    freq_t count = 1;
+    for (char symbol = 'a'; symbol < 'a' + 28; ++symbol) {
+        subject.append(count, symbol);
+        count += std::exchange(previous, count);
+    }
+    std::vector<freq_t> counts(0x100);
+    histogram(subject.data(), subject.size(), counts.data());
+    auto [coding, apriori, longest] = huffman::coding(frequency_map(counts.data()));
+    CHECK(longest.length <= L && std::all_of(coding.begin(), coding.end(), [](auto entry) {
+        return entry.second.length <= L;
+    }));
+    // the explicit table of the container keeps them
+    Header header = CONTAINER;
+    std::stringstream table;
+    encode_table(table, coding, header);
+    auto decoding = decode_table(table, header);
+    std::string block;
+    encode_block(subject.data(), subject.size(), block, code_table(coding), longest, header.flags);
+    BlockHeader head{};
+    std::memcpy(&head, block.data(), sizeof(head));
+    std::istringstream body{block.substr(sizeof(head))};
+    std::ostringstream output;
+    bool decoded = decode_block(decoding_table(decoding), body, output, head, header.flags);
+    CHECK(decoded && output.str() == subject);
+}
@@ -2,11 +2,19 @@
 // Created by mhq on 05/02/23.
 //
 #pragma once
+#include "container.h"
+
 #include <cstddef>
+#include <cstdint>
 #include <tuple>
 #include <istream>
 #include <ostream>
 #include <map>
+#include <array>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
 
 constexpr size_t L = 24; // max code length for alphabet of 25 chars
 struct Code {
@@ -49,6 +57,7 @@ namespace huffman {
     using AlphabetDecoding = std::map<Code, char>;
 
     const int PART_SIZE = 10'000;
+    constexpr size_t WINDOW_SIZE = 1 << 20; // bytes the stream decoders read and write at a time
 
     struct Coding {
         AlphabetCoding coding;
@@ -56,7 +65,62 @@ namespace huffman {
         Code longest;
     };
 
+    // Container: Header | table | (BlockHeader body)* | BlockHeader{} | BlockIndex[n] | n
+    // Legacy streams start with the table itself, so they never match the magic.
+    using container::Header;
+    constexpr Header CONTAINER{{'P', 'C', 'H', 'F'}, 1, 0, 0};
+    enum Flag : uint8_t {
+        CANONICAL = 1 << 0, // the table stores code lengths only
+        LOCAL_TABLES = 1 << 1, // every block body starts with a BlockTable byte, after the checksum if any
+        STREAMS = 1 << 2, // block bits are split into STREAM_COUNT streams
+        CHECKSUMS = 1 << 3, // every block body starts with the uint32_t CRC32C of its symbols
+    };
+    // With STREAMS the bits of a block are STREAM_COUNT streams of consecutive quarters of its symbols,
+    // each padded on its own, after a jump table of the byte lengths of all but the last one
+    constexpr int STREAM_COUNT = 4;
+    using JumpTable = std::array<uint32_t, STREAM_COUNT - 1>;
+    // With LOCAL_TABLES a block either uses the table of the container
+    // or carries canonical code lengths of its own between that byte and its bits
+    enum BlockTable : uint8_t {
+        SHARED_TABLE = 0,
+        LOCAL_TABLE = 1,
+    };
+
+    struct BlockHeader {
+        uint32_t length; // bytes of body
+        uint32_t symbols;
+    };
+    static_assert(sizeof(BlockHeader) == 8);
+
+    struct BlockIndex {
+        uint64_t offset; // of the BlockHeader, from the start of the container
+        BlockHeader block;
+    };
+    static_assert(sizeof(BlockIndex) == 16);
+    using Index = std::vector<BlockIndex>;
+
+    // Flat decoding table indexed by the next DECODE_BITS of the stream.
+    // Codes longer than that continue in second-level tables appended after the first level.
+    constexpr unsigned DECODE_BITS = 11;
+    struct DecodeEntry {
+        char symbols[2];
+        uint8_t count; // 0 links to a second-level table
+        uint8_t first_length; // bits of symbols[0]
+        uint8_t length; // bits of all symbols, or index bits of the second-level table
+        uint32_t link;
+    };
+    using DecodingTable = std::vector<DecodeEntry>;
+
+    // Codes indexed by byte, bits in stream order (first bit highest)
+    struct FlatCode {
+        uint32_t bits;
+        uint32_t length;
+    };
+    using CodeTable = std::array<FlatCode, 0x100>;
+
     FrequencyMap frequencies(std::istream& is);
+    void histogram(const char* data, size_t size, freq_t* counts);
+    FrequencyMap frequency_map(const freq_t* counts);
     Coding coding(FrequencyMap freqs);
     void encode_head(std::ostream &os, const AlphabetCoding &coding);
     EncodingStats encode_body(std::istream &is, std::ostream &os, const AlphabetCoding &coding, Code longest, size_t body_size_bits);
@@ -65,8 +129,34 @@ namespace huffman {
     std::pair<AprioriStats, EncodingStats> encode(std::istream& is, std::ostream& os);
     AlphabetDecoding decode_head(std::istream& is);
     void decode_body(const AlphabetDecoding& decoding, std::istream& is, std::ostream& os);
-    void decode(std::istream& is, std::ostream& os);
+    bool decode(std::istream& is, std::ostream& os); // false on a malformed table or block
+
+    CodeTable code_table(const AlphabetCoding &coding);
+    EncodingStats encode_bits(const char* data, size_t size, std::string& out, const CodeTable& table, Code longest, size_t body_size_bits);
+    // `flags` of the container select streams and checksums
+    EncodingStats encode_block(const char* data, size_t size, std::string& out, const CodeTable& table, Code longest, uint8_t flags);
+    bool decode_block(const DecodingTable& table, std::istream& is, std::ostream& os, BlockHeader block, uint8_t flags);
+    EncodingStats encode_local_block(const char* data, size_t size, std::string& out, const CodeTable* shared, Code longest, uint8_t flags);
+    bool decode_local_block(const DecodingTable& shared, std::istream& is, std::ostream& os, BlockHeader block, uint8_t flags);
+    bool verify_block(const DecodingTable& shared, const char* body, BlockHeader block, uint8_t flags);
+    EncodingStats encode_streams(const char* data, size_t size, std::string& out, const CodeTable& table, Code longest);
+    size_t decode_streams(const DecodingTable& table, const char* data, size_t size, size_t symbols, char* out);
+    DecodingTable decoding_table(const AlphabetDecoding& decoding);
+    size_t decode_bits(const DecodingTable& table, const char* data, size_t& bit, size_t bit_limit, size_t symbols, char* out);
+    Index index_blocks(const std::string& blocks, uint64_t offset);
+    void encode_index(std::ostream& os, const Index& index);
+    Index decode_index(std::string_view container);
+
+    Coding canonical_coding(const FrequencyMap& freqs);
+    AlphabetCoding canonical_codes(const std::vector<std::pair<char, uint8_t>>& lengths);
+    void encode_lengths(std::ostream &os, const AlphabetCoding &coding);
+    AlphabetDecoding decode_lengths(std::istream& is);
+    void encode_table(std::ostream &os, const AlphabetCoding &coding, const Header& header);
+    AlphabetDecoding decode_table(std::istream& is, const Header& header);
 }
 
 void test_huffman();
 void test_header();
+void test_canonical();
+void test_local_tables();
+void test_long_codes();
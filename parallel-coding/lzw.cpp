@@ -0,0 +1,416 @@
+#include "lzw.h"
+#include "check.h"
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+#include <array>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Bits of the next code after `emitted` codes since the last reset
+static unsigned code_bits(uint32_t emitted) {
+    uint32_t largest = std::min(lzw::FIRST + emitted, lzw::MAX_CODES) - 1;
+    unsigned bits = lzw::MIN_BITS;
+    while (bits < lzw::MAX_BITS && (largest >> bits) != 0) {
+        ++bits;
+    }
+    return bits;
+}
+
+// Number of equal bytes at the start of a and b, at most size
+static size_t common_length(const char* a, const char* b, size_t size) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= size; i += 16) {
+        __m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        auto mismatch = static_cast<unsigned>(~_mm_movemask_epi8(_mm_cmpeq_epi8(left, right)) & 0xffff);
+        if (mismatch != 0) {
+            return i + __builtin_ctz(mismatch);
+        }
+    }
+#endif
+    while (i < size && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+namespace {
+// Open addressing over (prefix code, byte) keys, twice as many slots as codes.
+// A slot packs stamp << 40 | key << 16 | code, it is empty unless its stamp is the current one,
+// so reset does not clear the table.
+// Every code also remembers its last child as code << 8 | byte: a run keeps extending the same phrase
+// by the same byte, and these are indexed by code, so a block's phrases stay in L1 while slots are scattered.
+// For every first byte the longest phrase is kept as the codes of its prefixes and where it occurs in the block:
+// every prefix of a phrase is a phrase too, so a new phrase matching k bytes of it starts at its k-th prefix
+// after one comparison of the bytes, instead of k dependent lookups.
+class Dictionary {
+    static constexpr unsigned SLOT_BITS = lzw::MAX_BITS + 1;
+    static constexpr uint64_t STAMPS = 1u << 24;
+    static constexpr size_t MIN_JUMP = 16; // shorter phrases are found as fast by their lookups
+    std::vector<uint64_t> slots;
+    std::vector<uint32_t> last_child;
+    std::vector<uint16_t> parent;
+    std::array<std::vector<uint16_t>, lzw::CLEAR> longest; // longest[byte][k] is its prefix of k + 1 bytes
+    std::array<size_t, lzw::CLEAR> occurrence;
+    uint64_t stamp = 0;
+    uint32_t next = lzw::FIRST;
+
+    static size_t slot(uint32_t key) {
+        return (key * 2654435761u) >> (32 - SLOT_BITS);
+    }
+
+public:
+    Dictionary() : slots(1u << SLOT_BITS), last_child(lzw::MAX_CODES), parent(lzw::MAX_CODES), occurrence{} {}
+
+    [[nodiscard]] bool full() const {
+        return next == lzw::MAX_CODES;
+    }
+
+    void reset() {
+        std::fill(last_child.begin(), last_child.begin() + next, 0);
+        if (++stamp == STAMPS) {
+            std::fill(slots.begin(), slots.end(), 0);
+            stamp = 1;
+        }
+        for (uint32_t byte = 0; byte < lzw::CLEAR; ++byte) {
+            longest[byte].assign(1, static_cast<uint16_t>(byte));
+        }
+        next = lzw::FIRST;
+    }
+
+    // The code of the longest prefix of data[phrase, size) along the longest phrase of its first byte, and its length
+    uint32_t match(const char* data, size_t phrase, size_t size, size_t& length) const {
+        auto byte = static_cast<unsigned char>(data[phrase]);
+        const auto& codes = longest[byte];
+        if (codes.size() < MIN_JUMP) {
+            length = 1;
+            return byte;
+        }
+        size_t limit = std::min(codes.size(), size - phrase);
+        length = 1 + common_length(data + phrase + 1, data + occurrence[byte] + 1, limit - 1);
+        return codes[length - 1];
+    }
+
+    // Records the phrase find_or_add just added, data[phrase, phrase + length)
+    void added(const char* data, size_t phrase, size_t length) {
+        auto byte = static_cast<unsigned char>(data[phrase]);
+        auto& codes = longest[byte];
+        if (length <= codes.size()) {
+            return;
+        }
+        uint32_t prefix = parent[next - 1];
+        if (codes.back() != prefix) {
+            // another branch grows longer, walk its prefixes back to the first byte
+            codes.resize(length - 1);
+            for (size_t k = length - 1; k-- > 0; prefix = parent[prefix]) {
+                codes[k] = static_cast<uint16_t>(prefix);
+            }
+        }
+        codes.push_back(static_cast<uint16_t>(next - 1));
+        occurrence[byte] = phrase;
+    }
+
+    // The code of prefix + byte, or adds it and returns MAX_CODES
+    uint32_t find_or_add(uint32_t prefix, unsigned char byte) {
+        uint32_t child = last_child[prefix];
+        if ((child & 0xff) == byte && child != 0) {
+            return child >> 8;
+        }
+        uint64_t key = stamp << 24 | prefix << 8 | byte;
+        size_t mask = slots.size() - 1;
+        for (size_t i = slot(prefix << 8 | byte); ; i = (i + 1) & mask) {
+            uint64_t entry = slots[i];
+            if (entry >> 40 != stamp) {
+                slots[i] = key << 16 | next;
+                last_child[prefix] = next << 8 | byte;
+                parent[next] = static_cast<uint16_t>(prefix);
+                ++next;
+                return lzw::MAX_CODES;
+            }
+            if (entry >> 16 == key) {
+                last_child[prefix] = static_cast<uint32_t>(entry & 0xffff) << 8 | byte;
+                return entry & 0xffff;
+            }
+        }
+    }
+};
+
+struct BitWriter {
+    std::string& out;
+    uint64_t buffer = 0;
+    unsigned count = 0;
+
+    // Whole bytes go out 32 bits at a time
+    void put(uint32_t code, unsigned bits) {
+        buffer |= static_cast<uint64_t>(code) << count;
+        count += bits;
+        if (count >= 32) {
+            char bytes[4] = {static_cast<char>(buffer), static_cast<char>(buffer >> 8),
+                             static_cast<char>(buffer >> 16), static_cast<char>(buffer >> 24)};
+            out.append(bytes, sizeof(bytes));
+            buffer >>= 32;
+            count -= 32;
+        }
+    }
+
+    void flush() {
+        for (; count > 0; count = count > 8 ? count - 8 : 0) {
+            out.push_back(static_cast<char>(buffer));
+            buffer >>= 8;
+        }
+        buffer = 0;
+    }
+};
+}
+
+lzw::EncodingStats lzw::encode_block(const char* data, size_t size, std::string& out) {
+    size_t start = out.size();
+    out.resize(start + sizeof(BlockHeader));
+    if (size == 0) {
+        std::memset(out.data() + start, 0, sizeof(BlockHeader));
+        return {sizeof(BlockHeader), 0};
+    }
+    thread_local Dictionary dictionary;
+    dictionary.reset();
+    BitWriter writer{out};
+    uint32_t emitted = 0;
+    unsigned bits = code_bits(emitted); // follows emitted
+    size_t phrase = 0; // start of the current phrase
+    size_t length = 0;
+    uint32_t prefix = dictionary.match(data, phrase, size, length);
+    for (size_t i = length; i < size; ++i) {
+        auto byte = static_cast<unsigned char>(data[i]);
+        uint32_t code = dictionary.find_or_add(prefix, byte);
+        if (code != MAX_CODES) {
+            prefix = code;
+            continue;
+        }
+        dictionary.added(data, phrase, i - phrase + 1);
+        writer.put(prefix, bits);
+        ++emitted;
+        if (bits < MAX_BITS && (FIRST + emitted - 1) >> bits != 0) {
+            ++bits;
+        }
+        if (dictionary.full()) {
+            writer.put(CLEAR, bits);
+            dictionary.reset();
+            emitted = 0;
+            bits = code_bits(emitted);
+        }
+        phrase = i;
+        prefix = dictionary.match(data, phrase, size, length);
+        i += length - 1;
+    }
+    writer.put(prefix, bits);
+    writer.flush();
+    BlockHeader header{static_cast<uint32_t>(out.size() - start - sizeof(BlockHeader)), static_cast<uint32_t>(size)};
+    std::memcpy(out.data() + start, &header, sizeof(header));
+    return {out.size() - start, size};
+}
+
+namespace {
+// Strings of the codes as (prefix code, last byte) chains, one entry behind the encoder
+struct Strings {
+    std::vector<uint16_t> prefix = std::vector<uint16_t>(lzw::MAX_CODES);
+    std::vector<unsigned char> byte = std::vector<unsigned char>(lzw::MAX_CODES);
+    std::vector<uint32_t> length = std::vector<uint32_t>(lzw::MAX_CODES);
+
+    Strings() {
+        for (uint32_t code = 0; code < lzw::CLEAR; ++code) {
+            byte[code] = static_cast<unsigned char>(code);
+            length[code] = 1;
+        }
+    }
+
+    void write(uint32_t code, char* end) const {
+        for (; code >= lzw::FIRST; code = prefix[code]) {
+            *--end = static_cast<char>(byte[code]);
+        }
+        *--end = static_cast<char>(code);
+    }
+};
+}
+
+// Returns the bytes of the block consumed, 0 for a malformed block, which leaves `out` as it was
+size_t lzw::decode_block(const char* data, size_t size, std::string& out) {
+    BlockHeader header{};
+    if (size < sizeof(header)) {
+        return 0;
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (header.length > size - sizeof(header) || header.symbols > BLOCK_SIZE) {
+        return 0;
+    }
+    auto body = reinterpret_cast<const unsigned char*>(data + sizeof(header));
+    size_t position = 0;
+    uint64_t buffer = 0;
+    unsigned count = 0;
+
+    thread_local Strings strings;
+    size_t start = out.size();
+    size_t end = start + header.symbols;
+    out.resize(end);
+    auto malformed = [&]() -> size_t {
+        out.resize(start);
+        return 0;
+    };
+    size_t output = start;
+    uint32_t emitted = 0;
+    uint32_t previous = CLEAR;
+    while (output < end) {
+        unsigned bits = code_bits(emitted);
+        while (count < bits && position < header.length) {
+            buffer |= static_cast<uint64_t>(body[position++]) << count;
+            count += 8;
+        }
+        if (count < bits) {
+            return malformed();
+        }
+        auto code = static_cast<uint32_t>(buffer & ((1u << bits) - 1));
+        buffer >>= bits;
+        count -= bits;
+        if (code == CLEAR) {
+            emitted = 0;
+            previous = CLEAR;
+            continue;
+        }
+        uint32_t next = FIRST + emitted - 1; // entry this code completes
+        if (previous == CLEAR ? code >= CLEAR : code > next || next >= MAX_CODES) {
+            return malformed();
+        }
+        // the entry is the previous string and the first byte of this one;
+        // for code == next that byte is the first one of the previous string, needed before writing
+        if (previous != CLEAR) {
+            strings.prefix[next] = static_cast<uint16_t>(previous);
+            strings.length[next] = strings.length[previous] + 1;
+            strings.byte[next] = static_cast<unsigned char>(out[output - strings.length[previous]]);
+        }
+        uint32_t length = strings.length[code];
+        if (length > end - output) {
+            return malformed();
+        }
+        strings.write(code, out.data() + output + length);
+        if (previous != CLEAR) {
+            strings.byte[next] = static_cast<unsigned char>(out[output]);
+        }
+        output += length;
+        previous = code;
+        ++emitted;
+    }
+    // the last code ends in the last byte of the body
+    if (position != header.length || count >= 8) {
+        return malformed();
+    }
+    return sizeof(header) + header.length;
+}
+
+size_t lzw::block_length(const char* data, size_t size) {
+    BlockHeader header{};
+    if (size < sizeof(header)) {
+        return 0;
+    }
+    std::memcpy(&header, data, sizeof(header));
+    return sizeof(header) + header.length;
+}
+
+std::vector<size_t> lzw::block_offsets(const char* data, size_t size, size_t position) {
+    std::vector<size_t> offsets;
+    while (position < size) {
+        size_t length = block_length(data + position, size - position);
+        if (length == 0 || length > size - position) {
+            break;
+        }
+        offsets.push_back(position);
+        position += length;
+    }
+    return offsets;
+}
+
+// Reads and writes a block at a time
+lzw::EncodingStats lzw::encode(std::istream& is, std::ostream& os) {
+    os.write(reinterpret_cast<const char*>(&CONTAINER), sizeof(CONTAINER));
+    EncodingStats stats{sizeof(CONTAINER), 0};
+    std::string block(BLOCK_SIZE, '\0');
+    std::string output;
+    while (is.read(block.data(), static_cast<std::streamsize>(block.size())) || is.gcount() > 0) {
+        auto size = static_cast<size_t>(is.gcount());
+        output.clear();
+        encode_block(block.data(), size, output);
+        os.write(output.data(), static_cast<std::streamsize>(output.size()));
+        stats.output_size += output.size();
+        stats.input_size += size;
+    }
+    return stats;
+}
+
+// False on a malformed container, the blocks before the malformed one are written
+bool lzw::decode(std::istream& is, std::ostream& os) {
+    std::string input = (std::ostringstream{} << is.rdbuf()).str();
+    if (!container::has_magic(input.data(), input.size(), CONTAINER)) {
+        return false;
+    }
+    std::string output;
+    bool intact = true;
+    for (size_t position = sizeof(Header); position < input.size(); ) {
+        size_t consumed = decode_block(input.data() + position, input.size() - position, output);
+        if (consumed == 0) {
+            intact = false;
+            break;
+        }
+        position += consumed;
+    }
+    os.write(output.data(), static_cast<std::streamsize>(output.size()));
+    return intact;
+}
+
+void test_lzw() {
+    // a repeated byte takes the code the decoder has not added yet (KwKwK),
+    // the pseudorandom bytes fill the dictionary and reset it, the last input spans two blocks
+    std::string random(300'000, '\0');
+    uint32_t state = 1;
+    for (auto& byte : random) {
+        state = state * 1103515245 + 12345;
+        byte = static_cast<char>(state >> 24);
+    }
+    std::string runs;
+    for (size_t i = 0; runs.size() < lzw::BLOCK_SIZE + 1000; ++i) {
+        runs.append(i % 97 + 1, static_cast<char>('a' + i % 4));
+    }
+    for (const std::string& subject : {std::string{}, std::string{"a"}, std::string(1000, 'a'),
+                                      std::string{"TOBEORNOTTOBEORTOBEORNOT"}, random, runs}) {
+        std::istringstream raw{subject};
+        std::stringstream coded;
+        lzw::encode(raw, coded);
+        std::stringstream result;
+        bool intact = lzw::decode(coded, result);
+        CHECK(intact && result.str() == subject);
+    }
+    std::string block;
+    lzw::encode_block(random.data(), random.size(), block);
+    CHECK(lzw::block_length(block.data(), block.size()) == block.size());
+    // a body cut short, with or without its header saying so, decodes nothing
+    std::string output;
+    size_t consumed = lzw::decode_block(block.data(), block.size() - 1, output);
+    CHECK(consumed == 0 && output.empty());
+    std::string truncated = block.substr(0, block.size() - 100);
+    uint32_t length = truncated.size() - sizeof(lzw::BlockHeader);
+    std::memcpy(truncated.data(), &length, sizeof(length));
+    consumed = lzw::decode_block(truncated.data(), truncated.size(), output);
+    CHECK(consumed == 0 && output.empty());
+    consumed = lzw::decode_block(block.data(), block.size(), output);
+    CHECK(consumed == block.size() && output == random);
+    // the blocks before a malformed one are still written
+    std::istringstream raw{runs};
+    std::stringstream coded;
+    lzw::encode(raw, coded);
+    std::istringstream cut{coded.str().substr(0, coded.str().size() - 1)};
+    std::ostringstream result;
+    bool intact = lzw::decode(cut, result);
+    CHECK(!intact && result.str() == runs.substr(0, lzw::BLOCK_SIZE));
+    std::istringstream plain{runs};
+    intact = lzw::decode(plain, result);
+    CHECK(!intact);
+}
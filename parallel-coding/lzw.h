@@ -0,0 +1,45 @@
+#pragma once
+#include "container.h"
+
+#include <ostream>
+#include <istream>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace lzw {
+    struct EncodingStats {
+        size_t output_size; // bytes
+        size_t input_size; // bytes
+    };
+
+    // Container: Header | (BlockHeader body)*
+    // Every block starts with a fresh dictionary, so blocks decode independently.
+    using container::Header;
+    constexpr Header CONTAINER{{'P', 'C', 'L', 'Z'}, 1, 0, 0};
+
+    struct BlockHeader {
+        uint32_t length; // bytes of body
+        uint32_t symbols; // at most BLOCK_SIZE
+    };
+    static_assert(sizeof(BlockHeader) == 8);
+
+    constexpr size_t BLOCK_SIZE = 1 << 20; // input bytes
+    // Codes are LSB-first, as wide as the largest code the dictionary can hold at that point.
+    // A full dictionary is reset with CLEAR.
+    constexpr unsigned MIN_BITS = 9;
+    constexpr unsigned MAX_BITS = 16;
+    constexpr uint32_t CLEAR = 0x100;
+    constexpr uint32_t FIRST = 0x101; // first phrase code
+    constexpr uint32_t MAX_CODES = 1u << MAX_BITS;
+
+    EncodingStats encode_block(const char* data, size_t size, std::string& out);
+    size_t decode_block(const char* data, size_t size, std::string& out);
+    size_t block_length(const char* data, size_t size);
+    std::vector<size_t> block_offsets(const char* data, size_t size, size_t position);
+
+    EncodingStats encode(std::istream& is, std::ostream& os);
+    bool decode(std::istream& is, std::ostream& os); // false when malformed
+}
+
+void test_lzw();
@@ -4,245 +4,2306 @@
 // start snippet header
 #include "huffman.h"
 #include "runlength.h"
+#include "lzw.h"
+#include "ans.h"
+#include "stats.h"
+#include "generator.h"
+#include "mapped_file.h"
 
+#include <cmath>
 #include <random>
 #include <cstring>
 #include <sstream>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <algorithm>
+#include <limits>
+#include <string_view>
 
+#include <unistd.h>
 #include <mpi.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 int MASTER_RANK = 0;
 const int ALPHABET_SIZE = 25;
+const int ROUND_BLOCKS = 16; // per rank
+const int TASK_BLOCKS = 16; // per task of the dynamic schedule
+const int WINDOW_TASKS = 16; // per rank, tasks of the dynamic schedule written together
+const size_t CHUNK_SIZE = 1 << 30; // bytes per MPI call, counts stay int
 // end snippet header
 
-void mpi_encode_huffman(const char* filename);
+// Huffman tables: one for the container, one per block, or per block whichever is cheaper
+enum class Tables {
+    GLOBAL,
+    LOCAL,
+    ADAPTIVE,
+};
+
+struct Options {
+    bool canonical = false;
+    Tables tables = Tables::GLOBAL;
+    bool compact = false;
+    bool streams = false; // Huffman blocks as huffman::STREAM_COUNT streams
+    bool streaming = false; // decode on the master window by window in constant memory
+    bool checksums = false; // CRC32C of every block of the Huffman and compact RLE containers
+    bool hierarchical = false; // reduce and gather inside every node before the nodes talk
+    bool dynamic = false; // ranks take blocks on demand instead of equal shares, LZW only with --input
+    int threads = 1; // per rank, 0 leaves the OpenMP default
+    const char *input = nullptr; // read with MPI-IO by all ranks instead of std::cin
+    const char *output = nullptr; // written with MPI-IO by all ranks instead of std::cout
+    stats::Format stats = stats::OFF;
+    // generate
+    unsigned long long size = 0; // 0 is PART_SIZE per rank
+    unsigned long long seed = 0;
+    bool seeded = false;
+    double zipf = 0; // exponent, 0 is uniform
+    double run_length = 1; // mean
+};
+
+// Ranks that share memory form a node, its lowest rank leads it and only leaders talk across nodes.
+// The master is the lowest rank of all, so it leads its node and is rank 0 among the leaders
+struct Hierarchy {
+    bool enabled = false;
+    bool leader = false;
+    MPI::Intracomm node;
+    MPI::Intracomm leaders; // MPI::COMM_NULL on the other ranks
+    std::vector<int> order; // master only: world ranks grouped by node, as node data arrives
+};
+Hierarchy hierarchy;
+
+// Command input: std::cin read by the master, or a file every rank reads its own ranges of
+struct Input {
+    bool parallel = false;
+    MPI::File file;
+    MPI::Offset size = 0; // only on the master for std::cin
+    MappedFile source; // std::cin on the master, mapped when it is redirected from a file
+
+    std::string_view data() const { return source.view(); }
+};
+
+// Non-blocking transfer; its buffers stay in place until wait()
+struct Transfer {
+    std::string part; // this rank's data
+    std::string whole; // gathered on the master
+    std::vector<MPI::Request> requests;
+    stats::Phase phase = stats::GATHER;
+};
+
+// Command output: std::cout on the master, or a file every rank writes its own parts of
+struct Output {
+    bool parallel = false;
+    MPI::File file;
+    MPI::Offset size = 0; // bytes written so far
+};
+
+bool parse_options(int argc, const char *argv[], int first, Options &options);
+bool applies(const char *command, const char *option);
+void init_threads(const Options &options);
+void init_hierarchy();
+std::vector<size_t> split(size_t size, int parts, size_t unit);
+void histogram_blocks(const std::string &subinput, huffman::freq_t *counts);
+std::string encode_blocks(const std::string &subinput, const huffman::CodeTable &table, Code longest, const Options &options);
+std::string decode_blocks(const std::string &subinput, const huffman::DecodingTable &table, const huffman::Header &header,
+                          bool &intact);
+void reduce_histogram(std::vector<huffman::freq_t> &counts);
+huffman::Coding make_coding(const std::vector<huffman::freq_t> &counts, const Options &options);
+huffman::Header make_header(const Options &options);
+void mpi_encode_huffman(const char* filename, const Options &options);
+bool mpi_decode_huffman(const Options &options);
+template<typename Decode>
+bool stream_decode(const Options &options, Decode decode);
+std::vector<huffman::freq_t> histogram_rounds(Input &in, int rank, int world_size);
+template<typename Encode>
+void encode_rounds(Input &in, Output &out, int rank, int world_size, Encode encode);
+void write_index(Output &out, const huffman::Index &index, int rank, int world_size);
+std::vector<size_t> index_bounds(const huffman::Index &index, size_t table_end, int world_size);
+struct TaskCounter;
+TaskCounter open_counter(int rank);
+long next_task(TaskCounter &counter);
+void close_counter(TaskCounter &counter);
+using Tasks = std::map<long, std::string>; // encoded tasks of a rank by number
+template<typename Process, typename Flush>
+void run_tasks(Input &in, size_t task_bytes, long window_tasks, int rank, Process process, Flush flush);
+std::vector<huffman::freq_t> histogram_dynamic(Input &in, int rank);
+std::vector<MPI::Offset> write_tasks(Output &out, const Tasks &tasks, long first_task, long end_task, int rank,
+                                     int world_size);
+template<typename Encode>
+void encode_dynamic(Input &in, Output &out, int rank, int world_size, Encode encode);
+void start_gatherv(Transfer &transfer, std::string part, int rank, int world_size);
+void start_scatterv(Transfer &transfer, std::string_view input, const std::vector<size_t> &bounds,
+                    int rank, int world_size);
+void wait(Transfer &transfer);
 std::string my_gatherv(std::string suboutput, int rank, int world_size);
-std::pair<std::string, int> my_scatter(std::string input, int world_size, int symbol_bytes);
-void mpi_encode_rle();
-void mpi_decode_rle();
-void mpi_generate();
+std::string node_gatherv(const std::string &part, int rank);
+void node_reduce(std::vector<huffman::freq_t> &counts);
+MPI::File open_file(const char *filename, int amode);
+Input open_input(const char *filename, int rank);
+std::string read_master(Input &in, MPI::Offset offset, size_t length);
+std::string read_ranges(Input &in, const std::vector<size_t> &bounds, int rank, int world_size);
+MPI::Offset round_bytes(int world_size);
+void start_round(Transfer &transfer, Input &in, long round, int rank, int world_size);
+huffman::Index read_index(Input &in);
+bool index_complete(const huffman::Index &index, size_t size);
+template<typename Length>
+std::vector<size_t> block_offsets(Input &in, size_t position, size_t max_head, Length block_length);
+std::vector<size_t> rle_block_offsets(Input &in);
+void close_input(Input &in);
+Output open_output(const Options &options);
+void start_read_at(Transfer &transfer, MPI::File &file, MPI::Offset offset);
+void start_write_at(Transfer &transfer, MPI::File &file, MPI::Offset offset);
+MPI::Offset start_write(Transfer &transfer, Output &out, std::string part, int rank, int world_size);
+void finish_write(Transfer &transfer, const Output &out, int rank);
+MPI::Offset write_parts(Output &out, std::string part, int rank, int world_size);
+void write_master(Output &out, const std::string &data, int rank);
+void close_output(Output &out);
+huffman::Index gather_index(const huffman::Index &index, int root, int rank, int world_size);
+std::pair<std::string, int> my_scatter(std::string_view input, int world_size, int symbol_bytes);
+std::string scatter_ranges(std::string_view input, const std::vector<size_t> &bounds, int rank, int world_size);
+std::vector<size_t> align_bounds(const std::vector<size_t> &bounds, const std::vector<size_t> &offsets, size_t end);
+rle::Header rle_header(const Options &options);
+void encode_rle_compact(Input &in, Output &out, const Options &options, int rank, int world_size);
+std::string rle_compact_blocks(const std::string &subinput, uint8_t flags, int rank, int world_size);
+bool decode_rle_compact(Input &in, Output &out, uint8_t flags, int rank, int world_size);
+std::string rle_decode_blocks(const std::string &subinput, uint8_t flags, bool &intact);
+void mpi_encode_rle(const Options &options);
+bool mpi_decode_rle(const Options &options);
+bool mpi_verify(const Options &options);
+std::vector<unsigned long long> verify_huffman(const std::string &subinput, const std::string &table,
+                                               const huffman::Header &header, size_t &blocks);
+std::vector<unsigned long long> verify_rle(const std::string &subinput, size_t &blocks);
+void mpi_encode_ans(const char *filename, const Options &options);
+bool mpi_decode_ans(const Options &options);
+std::string ans_encode_blocks(const std::string &subinput, const ans::EncodingTable &table);
+std::string ans_decode_blocks(const std::string &subinput, const ans::DecodingTable &table, bool &intact);
+void mpi_encode_lzw(const Options &options);
+bool mpi_decode_lzw(const Options &options);
+std::string lzw_encode_blocks(const std::string &subinput);
+std::string lzw_decode_blocks(const std::string &subinput, bool &intact);
+void mpi_generate(const Options &options);
+bool parse_stages(const char *list, std::vector<std::string> &stages);
+std::string pipeline_rle(const std::string &buffer, const Options &options, int rank, int world_size);
+std::string pipeline_huffman(const std::string &buffer, const Options &options, int rank, int world_size);
+std::string pipeline_decode_rle(const std::string &buffer, int rank, int world_size, bool &intact);
+std::string pipeline_decode_huffman(const std::string &buffer, int rank, int world_size, bool &intact);
+bool mpi_pipeline(const std::vector<std::string> &stages, const Options &options);
 
 // std::ios_base::sync_with_stdio(false);
 
 // start snippet main
 int main(int argc, const char *argv[]) {
-    if (argc == 2 && strcmp(argv[1], "generate") == 0) {
-        mpi_generate();
+    Options options;
+    if (argc >= 2 && strcmp(argv[1], "generate") == 0 && parse_options(argc, argv, 2, options)) {
+        mpi_generate(options);
         return EXIT_SUCCESS;
     }
-    if (argc == 3 && strcmp(argv[1], "encode_huffman") == 0) {
-        mpi_encode_huffman(argv[2]);
+    if (argc >= 3 && strcmp(argv[1], "encode_huffman") == 0 && parse_options(argc, argv, 3, options)) {
+        mpi_encode_huffman(argv[2], options);
         return EXIT_SUCCESS;
     }
-    if (argc == 2 && strcmp(argv[1], "decode_huffman") == 0) {
-        huffman::decode(std::cin, std::cout);
+    if (argc >= 2 && strcmp(argv[1], "decode_huffman") == 0 && parse_options(argc, argv, 2, options)) {
+        return mpi_decode_huffman(options) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (argc >= 2 && strcmp(argv[1], "encode_rle") == 0 && parse_options(argc, argv, 2, options)) {
+        mpi_encode_rle(options);
         return EXIT_SUCCESS;
     }
-    if (argc == 2 && strcmp(argv[1], "encode_rle") == 0) {
-        mpi_encode_rle();
+    if (argc >= 2 && strcmp(argv[1], "decode_rle") == 0 && parse_options(argc, argv, 2, options)) {
+        return mpi_decode_rle(options) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (argc >= 3 && strcmp(argv[1], "encode_ans") == 0 && parse_options(argc, argv, 3, options)) {
+        mpi_encode_ans(argv[2], options);
         return EXIT_SUCCESS;
     }
-    if (argc == 2 && strcmp(argv[1], "decode_rle") == 0) {
-        mpi_decode_rle();
+    if (argc >= 2 && strcmp(argv[1], "decode_ans") == 0 && parse_options(argc, argv, 2, options)) {
+        return mpi_decode_ans(options) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (argc >= 2 && strcmp(argv[1], "encode_lzw") == 0 && parse_options(argc, argv, 2, options)) {
+        mpi_encode_lzw(options);
         return EXIT_SUCCESS;
     }
+    if (argc >= 2 && strcmp(argv[1], "decode_lzw") == 0 && parse_options(argc, argv, 2, options)) {
+        return mpi_decode_lzw(options) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (argc >= 2 && strcmp(argv[1], "verify") == 0 && parse_options(argc, argv, 2, options)) {
+        return mpi_verify(options) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    std::vector<std::string> stages;
+    if (argc >= 3 && strcmp(argv[1], "pipeline") == 0 && parse_stages(argv[2], stages)
+        && parse_options(argc, argv, 3, options)) {
+        return mpi_pipeline(stages, options) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
     return EXIT_FAILURE;
 }
 // end snippet main
 
-void generate_file(const std::string &alphabet,
-                   size_t characters_count,
-                   std::ostream &os,
-                   std::mt19937 &generator) {
-    std::uniform_int_distribution<size_t> distribution(0, alphabet.size() - 1);
-    for (int i = 0; i < characters_count; ++i) {
-        os << alphabet[distribution(generator)];
+// Options of every command besides COMMON_OPTIONS, parse_options rejects the options of other commands
+const std::vector<const char*> COMMON_OPTIONS = {"--threads", "--stats", "--hierarchical"};
+const std::map<std::string, std::vector<const char*>> COMMAND_OPTIONS = {
+    {"generate", {"--output", "--size", "--seed", "--zipf", "--run-length"}},
+    {"encode_huffman", {"--output", "--canonical", "--tables", "--streams", "--checksums", "--dynamic"}},
+    {"decode_huffman", {"--input", "--output", "--streaming"}},
+    {"encode_rle", {"--input", "--output", "--compact", "--checksums"}},
+    {"decode_rle", {"--input", "--output", "--streaming"}},
+    {"encode_ans", {"--output", "--dynamic"}},
+    {"decode_ans", {"--input", "--output"}},
+    {"encode_lzw", {"--input", "--output", "--dynamic"}},
+    {"decode_lzw", {"--input", "--output"}},
+    {"verify", {"--input"}},
+    {"pipeline", {"--input", "--output", "--compact", "--checksums", "--canonical", "--tables", "--streams"}},
+};
+
+// Options that no command has are left for parse_options to report as unknown
+bool applies(const char *command, const char *option) {
+    auto named = [option](const std::vector<const char*> &options) {
+        return std::any_of(options.begin(), options.end(), [option](const char *name) {
+            return strcmp(name, option) == 0 || (strncmp(name, option, strlen(name)) == 0 && option[strlen(name)] == '=');
+        });
+    };
+    if (named(COMMON_OPTIONS)) {
+        return true;
     }
+    auto own = COMMAND_OPTIONS.find(command);
+    if (own != COMMAND_OPTIONS.end() && named(own->second)) {
+        return true;
+    }
+    return std::none_of(COMMAND_OPTIONS.begin(), COMMAND_OPTIONS.end(), [&](const auto &entry) {
+        return named(entry.second);
+    });
 }
 
-// start snippet mpi_encode_huffman
-void mpi_encode_huffman(const char *filename) {
-    MPI::Init();
-    int rank = MPI::COMM_WORLD.Get_rank();
-    int world_size = MPI::COMM_WORLD.Get_size();
-    std::string input;
+bool parse_options(int argc, const char *argv[], int first, Options &options) {
+    const char *command = argv[1];
+    for (int i = first; i < argc; ++i) {
+        if (!applies(command, argv[i])) {
+            std::cerr << argv[i] << " does not apply to " << command << "\nusage: " << command;
+            for (auto option : COMMAND_OPTIONS.at(command)) {
+                std::cerr << " [" << option << ']';
+            }
+            for (auto option : COMMON_OPTIONS) {
+                std::cerr << " [" << option << ']';
+            }
+            std::cerr << '\n';
+            return false;
+        }
+        if (strcmp(argv[i], "--canonical") == 0) {
+            options.canonical = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--tables") == 0 && i + 1 < argc) {
+            ++i;
+            if (strcmp(argv[i], "global") == 0) {
+                options.tables = Tables::GLOBAL;
+            } else if (strcmp(argv[i], "local") == 0) {
+                options.tables = Tables::LOCAL;
+            } else if (strcmp(argv[i], "adaptive") == 0) {
+                options.tables = Tables::ADAPTIVE;
+            } else {
+                std::cerr << "unknown tables " << argv[i] << '\n';
+                return false;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--streams") == 0) {
+            options.streams = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--streaming") == 0) {
+            options.streaming = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--checksums") == 0) {
+            options.checksums = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--hierarchical") == 0) {
+            options.hierarchical = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--dynamic") == 0) {
+            options.dynamic = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--compact") == 0) {
+            options.compact = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.threads = std::atoi(argv[++i]);
+            continue;
+        }
+        if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=json") == 0) {
+            options.stats = argv[i][7] == '=' ? stats::JSON : stats::TEXT;
+            continue;
+        }
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            options.size = std::strtoull(argv[++i], nullptr, 10);
+            continue;
+        }
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            options.seed = std::strtoull(argv[++i], nullptr, 10);
+            options.seeded = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--zipf") == 0 && i + 1 < argc) {
+            options.zipf = std::atof(argv[++i]);
+            continue;
+        }
+        if (strcmp(argv[i], "--run-length") == 0 && i + 1 < argc) {
+            options.run_length = std::atof(argv[++i]);
+            continue;
+        }
+        if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+            options.input = argv[++i];
+            continue;
+        }
+        if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            options.output = argv[++i];
+            continue;
+        }
+        std::cerr << "unknown option " << argv[i] << '\n';
+        return false;
+    }
+    if (strcmp(command, "encode_rle") == 0 && options.checksums && !options.compact) {
+        std::cerr << "--checksums needs --compact\n";
+        return false;
+    }
+    if (strcmp(command, "encode_lzw") == 0 && options.dynamic && options.input == nullptr) {
+        std::cerr << "--dynamic needs --input\n";
+        return false;
+    }
+    return true;
+}
+
+// Hybrid mode: one rank per node, OpenMP threads inside it; only the master thread talks MPI
+void init_threads(const Options &options) {
+    MPI::Init_thread(MPI::THREAD_FUNNELED);
+    stats::start(options.stats);
+    if (options.hierarchical) {
+        init_hierarchy();
+    }
+#ifdef _OPENMP
+    if (options.threads > 0) {
+        omp_set_num_threads(options.threads);
+    }
+#endif
+}
+
+// Boundaries of `parts` contiguous ranges of [0, size), all but the last a multiple of `unit`
+std::vector<size_t> split(size_t size, int parts, size_t unit) {
+    size_t units = size / unit;
+    std::vector<size_t> bounds(parts + 1, size);
+    for (int i = 0; i < parts; ++i) {
+        bounds[i] = units * i / parts * unit;
+    }
+    return bounds;
+}
+
+// start snippet huffman_blocks
+// Threads of a rank share its PART_SIZE blocks
+void histogram_blocks(const std::string &subinput, huffman::freq_t *counts) {
+    stats::Timer timer(stats::HISTOGRAM, subinput.size());
+    long blocks = (static_cast<long>(subinput.size()) + huffman::PART_SIZE - 1) / huffman::PART_SIZE;
+#pragma omp parallel for reduction(+: counts[:0x100])
+    for (long i = 0; i < blocks; ++i) {
+        size_t size = std::min(subinput.size() - i * huffman::PART_SIZE, static_cast<size_t>(huffman::PART_SIZE));
+        huffman::histogram(subinput.data() + i * huffman::PART_SIZE, size, counts);
+    }
+}
+
+// Local tables are chosen per block, adaptive blocks may also fall back to `table`
+std::string encode_blocks(const std::string &subinput, const huffman::CodeTable &table, Code longest, const Options &options) {
+    stats::Timer timer(stats::ENCODE, subinput.size());
+    long blocks = (static_cast<long>(subinput.size()) + huffman::PART_SIZE - 1) / huffman::PART_SIZE;
+    std::vector<std::string> encoded(blocks);
+    uint8_t flags = make_header(options).flags;
+#pragma omp parallel for schedule(dynamic)
+    for (long i = 0; i < blocks; ++i) {
+        size_t size = std::min(subinput.size() - i * huffman::PART_SIZE, static_cast<size_t>(huffman::PART_SIZE));
+        const char *block = subinput.data() + i * huffman::PART_SIZE;
+        if (options.tables == Tables::GLOBAL) {
+            huffman::encode_block(block, size, encoded[i], table, longest, flags);
+        } else {
+            huffman::encode_local_block(block, size, encoded[i], options.tables == Tables::ADAPTIVE ? &table : nullptr,
+                                        longest, flags);
+        }
+    }
+    std::string suboutput;
+    for (auto &block : encoded) {
+        suboutput += block;
+    }
+    return suboutput;
+}
+
+void reduce_histogram(std::vector<huffman::freq_t> &counts) {
+    stats::Timer timer(stats::ALLREDUCE, counts.size() * sizeof(huffman::freq_t));
+    if (hierarchy.enabled) {
+        node_reduce(counts);
+        return;
+    }
+    MPI::COMM_WORLD.Allreduce(MPI_IN_PLACE, counts.data(), static_cast<int>(counts.size()),
+                              MPI::UNSIGNED_LONG_LONG, MPI::SUM);
+}
+
+// `subinput` is a range of whole blocks with their headers, a malformed block clears `intact`
+std::string decode_blocks(const std::string &subinput, const huffman::DecodingTable &table, const huffman::Header &header,
+                          bool &intact) {
+    stats::Timer timer(stats::DECODE, subinput.size());
+    auto blocks = huffman::index_blocks(subinput, 0);
+    std::vector<std::string> decoded(blocks.size());
+    std::vector<char> complete(blocks.size());
+#pragma omp parallel for schedule(dynamic)
+    for (long i = 0; i < static_cast<long>(blocks.size()); ++i) {
+        std::istringstream block_stream {subinput.substr(blocks[i].offset + sizeof(huffman::BlockHeader), blocks[i].block.length)};
+        std::ostringstream block_output;
+        if (header.flags & huffman::LOCAL_TABLES) {
+            complete[i] = huffman::decode_local_block(table, block_stream, block_output, blocks[i].block, header.flags);
+        } else {
+            complete[i] = huffman::decode_block(table, block_stream, block_output, blocks[i].block, header.flags);
+        }
+        decoded[i] = block_output.str();
+    }
+    intact = std::all_of(complete.begin(), complete.end(), [](char ok) { return ok; });
+    std::string suboutput;
+    for (auto &block : decoded) {
+        suboutput += block;
+    }
+    return suboutput;
+}
+
+huffman::Coding make_coding(const std::vector<huffman::freq_t> &counts, const Options &options) {
+    stats::Timer timer(stats::CODING);
+    auto frequencies = huffman::frequency_map(counts.data());
+    return options.canonical ? huffman::canonical_coding(frequencies) : huffman::coding(frequencies);
+}
+
+huffman::Header make_header(const Options &options) {
+    huffman::Header header = huffman::CONTAINER;
+    // only local tables leave the container table empty, lengths are the shortest way to store that
+    if (options.canonical || options.tables == Tables::LOCAL) {
+        header.flags |= huffman::CANONICAL;
+    }
+    if (options.tables != Tables::GLOBAL) {
+        header.flags |= huffman::LOCAL_TABLES;
+    }
+    if (options.streams) {
+        header.flags |= huffman::STREAMS;
+    }
+    if (options.checksums) {
+        header.flags |= huffman::CHECKSUMS;
+    }
+    return header;
+}
+// end snippet huffman_blocks
+// start snippet rounds
+// First pass of the block coders: histogram of the input read in rounds,
+// round r + 1 is read while round r is counted
+std::vector<huffman::freq_t> histogram_rounds(Input &in, int rank, int world_size) {
+    long rounds = (in.size + round_bytes(world_size) - 1) / round_bytes(world_size);
+    Transfer reads[2];
+    std::vector<huffman::freq_t> counts(0x100);
+    for (long r = 0; r < rounds; ++r) {
+        if (r == 0) {
+            start_round(reads[0], in, 0, rank, world_size);
+        }
+        wait(reads[r % 2]);
+        if (r + 1 < rounds) {
+            start_round(reads[(r + 1) % 2], in, r + 1, rank, world_size);
+        }
+        histogram_blocks(reads[r % 2].part, counts.data());
+    }
+    return counts;
+}
+
+// Second pass: every rank encodes its blocks of the round and indexes them,
+// the output of round r - 1 is in flight meanwhile; the index closes the container
+template<typename Encode>
+void encode_rounds(Input &in, Output &out, int rank, int world_size, Encode encode) {
+    long rounds = (in.size + round_bytes(world_size) - 1) / round_bytes(world_size);
+    Transfer reads[2];
+    Transfer writes[2];
+    huffman::Index index;
+    for (long r = 0; r < rounds; ++r) {
+        if (r == 0) {
+            start_round(reads[0], in, 0, rank, world_size);
+        }
+        wait(reads[r % 2]);
+        if (r + 1 < rounds) {
+            start_round(reads[(r + 1) % 2], in, r + 1, rank, world_size);
+        }
+        auto suboutput = encode(reads[r % 2].part);
+        finish_write(writes[(r + 1) % 2], out, rank);
+        auto offset = start_write(writes[r % 2], out, std::move(suboutput), rank, world_size);
+        auto round_index = huffman::index_blocks(writes[r % 2].part, offset);
+        index.insert(index.end(), round_index.begin(), round_index.end());
+    }
+    finish_write(writes[(rounds + 1) % 2], out, rank);
+    write_index(out, index, rank, world_size);
+}
+
+// The blocks of all ranks close the container
+void write_index(Output &out, const huffman::Index &index, int rank, int world_size) {
+    auto all_index = gather_index(index, MASTER_RANK, rank, world_size);
+    std::ostringstream tail;
+    if (rank == MASTER_RANK) {
+        huffman::encode_index(tail, all_index);
+    }
+    write_master(out, tail.str(), rank);
+}
+
+// Contiguous ranges of whole indexed blocks for every rank, master only
+std::vector<size_t> index_bounds(const huffman::Index &index, size_t table_end, int world_size) {
+    std::vector<size_t> bounds;
+    size_t blocks_end = index.empty() ? table_end
+            : index.back().offset + sizeof(huffman::BlockHeader) + index.back().block.length;
+    auto [part, extra] = std::div(static_cast<long>(index.size()), static_cast<long>(world_size));
+    size_t first = 0;
+    for (int i = 0; i <= world_size; ++i) {
+        bounds.push_back(first < index.size() ? index[first].offset : blocks_end);
+        first += part + (i < extra ? 1 : 0);
+    }
+    return bounds;
+}
+// end snippet rounds
+// start snippet dynamic
+// Next task number in an RMA window on the master, ranks take tasks with an atomic fetch-and-add,
+// so a slow or busy host just takes fewer of them
+struct TaskCounter {
+    MPI_Win window = MPI_WIN_NULL;
+    long *next = nullptr; // on the master
+};
+
+TaskCounter open_counter(int rank) {
+    TaskCounter counter;
+    // one-sided calls have no C++ bindings
+    MPI_Win_allocate(rank == MASTER_RANK ? sizeof(long) : 0, sizeof(long), MPI_INFO_NULL, MPI_COMM_WORLD,
+                     &counter.next, &counter.window);
+    MPI_Win_lock_all(0, counter.window);
     if (rank == MASTER_RANK) {
-        input = (std::ostringstream{} << std::ifstream{filename}.rdbuf()).str();
+        *counter.next = 0;
+        MPI_Win_sync(counter.window);
+    }
+    MPI::COMM_WORLD.Barrier();
+    return counter;
+}
+
+long next_task(TaskCounter &counter) {
+    long one = 1;
+    long task;
+    MPI_Fetch_and_op(&one, &task, MPI_LONG, MASTER_RANK, 0, MPI_SUM, counter.window);
+    MPI_Win_flush(MASTER_RANK, counter.window);
+    return task;
+}
+
+void close_counter(TaskCounter &counter) {
+    MPI_Win_unlock_all(counter.window);
+    MPI_Win_free(&counter.window);
+}
+
+// Every rank reads and processes tasks of `task_bytes` until none are left, the next task is read meanwhile.
+// Task numbers go in windows of `window_tasks`: once a window is processed all ranks call `flush` with its end,
+// a rank that already took a task of the next window keeps it until then
+template<typename Process, typename Flush>
+void run_tasks(Input &in, size_t task_bytes, long window_tasks, int rank, Process process, Flush flush) {
+    long task_count = (in.size + task_bytes - 1) / task_bytes;
+    auto start_task = [&](Transfer &transfer, long task) {
+        MPI::Offset offset = task * task_bytes;
+        transfer.part.assign(std::min(in.size - offset, static_cast<MPI::Offset>(task_bytes)), '\0');
+        start_read_at(transfer, in.file, offset);
     };
-    std::string subinput;
-    subinput.resize(huffman::PART_SIZE);
-    MPI::COMM_WORLD.Scatter(input.data(), huffman::PART_SIZE, MPI::CHAR,
-                            subinput.data(), huffman::PART_SIZE, MPI::CHAR,
-                            MASTER_RANK);
-    auto subinput_stream = std::istringstream{subinput};
-    auto subfrequencies = huffman::frequencies(subinput_stream);
-    std::vector<huffman::freq_t> data(0x100);
-    for (auto [k, freq] : subfrequencies) {
-        data[static_cast<unsigned char>(k)] = freq;
+    auto counter = open_counter(rank);
+    Transfer reads[2];
+    long task = next_task(counter);
+    if (task < task_count) {
+        start_task(reads[0], task);
     }
-    MPI::COMM_WORLD.Allreduce(MPI_IN_PLACE, data.data(), 0x100, MPI::UNSIGNED_LONG_LONG, MPI::SUM);
-    std::map<char, huffman::freq_t> frequencies;
-    for (int i = 0; i < 0x100; ++i) {
-        if (data[i] == 0) {
-            continue;
+    int i = 0;
+    for (long window_end = window_tasks;; window_end += window_tasks) {
+        long end = std::min(window_end, task_count);
+        for (; task < end; ++i) {
+            long next = next_task(counter);
+            wait(reads[i % 2]);
+            if (next < task_count) {
+                start_task(reads[(i + 1) % 2], next);
+            }
+            process(task, reads[i % 2].part);
+            task = next;
+        }
+        flush(end);
+        if (end == task_count) {
+            break;
         }
-        frequencies[i] = data[i];
     }
-    auto [coding, apriori, longest] = huffman::coding(frequencies);
-    size_t body_part_size = 0;
-    for (auto [k, freq] : subfrequencies) {
-        body_part_size += freq * coding[k].length;
+    close_counter(counter);
+}
+
+// First pass of the block coders with the dynamic schedule
+std::vector<huffman::freq_t> histogram_dynamic(Input &in, int rank) {
+    std::vector<huffman::freq_t> counts(0x100);
+    run_tasks(in, static_cast<size_t>(TASK_BLOCKS) * huffman::PART_SIZE, std::numeric_limits<long>::max(), rank,
+              [&](long, const std::string &part) {
+        histogram_blocks(part, counts.data());
+    }, [](long) {});
+    return counts;
+}
+
+// Tasks `first_task` to `end_task` of all ranks in the order of their numbers,
+// returns where the tasks of this rank start
+std::vector<MPI::Offset> write_tasks(Output &out, const Tasks &tasks, long first_task, long end_task, int rank,
+                                     int world_size) {
+    long task_count = end_task - first_task;
+    std::vector<unsigned long long> sizes(task_count, 0);
+    for (auto &[task, data] : tasks) {
+        sizes[task - first_task] = data.size();
+    }
+    MPI::COMM_WORLD.Allreduce(MPI_IN_PLACE, sizes.data(), static_cast<int>(task_count),
+                              MPI::UNSIGNED_LONG_LONG, MPI::SUM);
+    std::vector<MPI::Offset> starts(task_count + 1, out.size);
+    for (long i = 0; i < task_count; ++i) {
+        starts[i + 1] = starts[i] + static_cast<MPI::Offset>(sizes[i]);
+    }
+    std::vector<MPI::Offset> offsets;
+    for (auto &[task, data] : tasks) {
+        offsets.push_back(starts[task - first_task]);
+    }
+    if (out.parallel) {
+        Transfer transfer;
+        for (auto &[task, data] : tasks) {
+            for (size_t done = 0; done < data.size(); done += CHUNK_SIZE) {
+                int count = static_cast<int>(std::min(data.size() - done, CHUNK_SIZE));
+                transfer.requests.push_back(out.file.Iwrite_at(starts[task - first_task] + done, data.data() + done,
+                                                               count, MPI::CHAR));
+            }
+        }
+        transfer.phase = stats::WRITE;
+        wait(transfer);
+    } else {
+        // the master gets the tasks grouped by rank and puts them in order
+        std::string part;
+        std::vector<long> numbers;
+        for (auto &[task, data] : tasks) {
+            part += data;
+            numbers.push_back(task);
+        }
+        int count = static_cast<int>(numbers.size());
+        std::vector<int> counts(world_size);
+        MPI::COMM_WORLD.Gather(&count, 1, MPI::INT, counts.data(), 1, MPI::INT, MASTER_RANK);
+        std::vector<int> displacements(world_size, 0);
+        for (int i = 1; i < world_size; ++i) {
+            displacements[i] = displacements[i - 1] + counts[i - 1];
+        }
+        std::vector<long> all_numbers(rank == MASTER_RANK ? task_count : 0);
+        MPI::COMM_WORLD.Gatherv(numbers.data(), count, MPI::LONG,
+                                all_numbers.data(), counts.data(), displacements.data(), MPI::LONG, MASTER_RANK);
+        auto whole = my_gatherv(std::move(part), rank, world_size);
+        if (rank == MASTER_RANK) {
+            std::vector<size_t> positions(task_count);
+            size_t position = 0;
+            for (long task : all_numbers) {
+                positions[task - first_task] = position;
+                position += sizes[task - first_task];
+            }
+            stats::Timer timer(stats::WRITE, whole.size());
+            for (long i = 0; i < task_count; ++i) {
+                std::cout.write(whole.data() + positions[i], static_cast<std::streamsize>(sizes[i]));
+            }
+        }
     }
+    out.size = starts.back();
+    return offsets;
+}
 
-    subinput_stream.clear();
-    subinput_stream.seekg(0, std::ios::beg); // rewind
+// Second pass of the block coders with the dynamic schedule, a task is TASK_BLOCKS blocks
+template<typename Encode>
+void encode_dynamic(Input &in, Output &out, int rank, int world_size, Encode encode) {
+    size_t task_bytes = static_cast<size_t>(TASK_BLOCKS) * huffman::PART_SIZE;
+    Tasks tasks;
+    huffman::Index index;
+    long first_task = 0;
+    run_tasks(in, task_bytes, static_cast<long>(WINDOW_TASKS) * world_size, rank, [&](long task, const std::string &part) {
+        tasks[task] = encode(part);
+    }, [&](long end_task) {
+        auto offsets = write_tasks(out, tasks, first_task, end_task, rank, world_size);
+        size_t i = 0;
+        for (auto &[task, data] : tasks) {
+            auto task_index = huffman::index_blocks(data, offsets[i++]);
+            index.insert(index.end(), task_index.begin(), task_index.end());
+        }
+        tasks.clear();
+        first_task = end_task;
+    });
+    write_index(out, index, rank, world_size);
+}
+// end snippet dynamic
+// start snippet mpi_encode_huffman
+void mpi_encode_huffman(const char *filename, const Options &options) {
+    init_threads(options);
+    int rank = MPI::COMM_WORLD.Get_rank();
+    int world_size = MPI::COMM_WORLD.Get_size();
+    auto in = open_input(filename, rank);
+    // first pass: global histogram, blocks with local tables only need it to compare against
+    huffman::Coding global{};
+    if (options.tables != Tables::LOCAL) {
+        auto data = options.dynamic ? histogram_dynamic(in, rank) : histogram_rounds(in, rank, world_size);
+        reduce_histogram(data);
+        global = make_coding(data, options);
+    }
+    auto table = huffman::code_table(global.coding);
+    auto header = make_header(options);
 
-    std::ostringstream suboutput_stream;
+    auto out = open_output(options);
+    std::ostringstream head;
     if (rank == MASTER_RANK) {
-        huffman::encode_head(std::cout, coding);
+        head.write(reinterpret_cast<const char*>(&header), sizeof(huffman::Header));
+        huffman::encode_table(head, global.coding, header);
     }
-    huffman::encode_body(subinput_stream, suboutput_stream, coding, longest, body_part_size);
-    auto output = my_gatherv(suboutput_stream.str(), rank, world_size);
-    if (rank == MASTER_RANK) {
-        std::cout << output;
+    write_master(out, head.str(), rank);
+    auto encode = [&](const std::string &part) {
+        return encode_blocks(part, table, global.longest, options);
+    };
+    if (options.dynamic) {
+        encode_dynamic(in, out, rank, world_size, encode);
+    } else {
+        encode_rounds(in, out, rank, world_size, encode);
     }
     if (rank == MASTER_RANK) {
+        if (options.tables != Tables::LOCAL) {
+            std::cerr
+                << "цена кодирования = "
+                << static_cast<double>(global.apriori.body_size_bits) / static_cast<double>(global.apriori.message_length) << '\n';
+        }
         std::cerr
-            << "цена кодирования = "
-            << static_cast<double>(apriori.body_size_bits) / static_cast<double>(apriori.message_length) << '\n'
             << "коэффициент сжатия = "
-            << static_cast<double>(output.size()) / static_cast<double>(input.size()) << '\n';
+            << static_cast<double>(out.size) / static_cast<double>(in.size) << '\n';
     }
+    close_input(in);
+    close_output(out);
+    stats::report(std::cerr, rank, world_size, MASTER_RANK);
     MPI::Finalize();
 }
 // end snippet mpi_encode_huffman
-// start snippet my_gatherv
-std::string my_gatherv(std::string suboutput, int rank, int world_size) {
-    int size = suboutput.size();
-    std::vector<int> sizes;
+// start snippet stream_decode
+// The master decodes std::cin or --input as it arrives, the other ranks only wait.
+// False on the master when the input cannot be opened or `decode` finds it malformed
+template<typename Decode>
+bool stream_decode(const Options &options, Decode decode) {
+    init_threads(options);
+    int rank = MPI::COMM_WORLD.Get_rank();
+    int world_size = MPI::COMM_WORLD.Get_size();
+    bool intact = true;
     if (rank == MASTER_RANK) {
-        sizes.resize(world_size);
+        std::ifstream input;
+        std::ofstream output;
+        if (options.input != nullptr) {
+            input.open(options.input, std::ios::binary);
+        }
+        if (options.output != nullptr) {
+            output.open(options.output, std::ios::binary | std::ios::trunc);
+        }
+        std::istream &is = options.input != nullptr ? input : std::cin;
+        std::ostream &os = options.output != nullptr ? output : std::cout;
+        if (!is || !os) {
+            std::cerr << "cannot open " << (!is ? options.input : options.output) << '\n';
+            intact = false;
+        } else {
+            stats::Timer timer(stats::DECODE);
+            intact = decode(is, os);
+            os.flush();
+        }
+    }
+    stats::report(std::cerr, rank, world_size, MASTER_RANK);
+    MPI::Finalize();
+    return intact;
+}
+// end snippet stream_decode
+// start snippet mpi_decode_huffman
+// False when the container is malformed, the intact blocks are still written
+bool mpi_decode_huffman(const Options &options) {
+    if (options.streaming) {
+        return stream_decode(options, [](std::istream &is, std::ostream &os) {
+            if (!huffman::decode(is, os)) {
+                std::cerr << "malformed Huffman container\n";
+                return false;
+            }
+            return true;
+        });
     }
-    MPI::COMM_WORLD.Gather(&size, 1, MPI::INT,
-                           sizes.data(), 1, MPI::INT, MASTER_RANK);
-    std::vector<int> displacements;
+    init_threads(options);
+    int rank = MPI::COMM_WORLD.Get_rank();
+    int world_size = MPI::COMM_WORLD.Get_size();
+    auto in = open_input(options.input, rank);
+    huffman::Index index;
+    std::string table;
+    huffman::Header header{};
+    int container = 0;
+    size_t table_end = 0;
     if (rank == MASTER_RANK) {
-        displacements.resize(world_size, 0);
-        for (int i = 1; i < world_size; i++) {
-            displacements[i] = (displacements[i - 1] + sizes[i - 1]);
+        auto head = read_master(in, 0, std::min(static_cast<size_t>(in.size), sizeof(header)));
+        std::memcpy(&header, head.data(), head.size());
+        container = container::has_magic(head.data(), head.size(), huffman::CONTAINER);
+        if (container) {
+            index = read_index(in);
+            table_end = index.empty() ? in.size : index.front().offset;
+            table = read_master(in, sizeof(huffman::Header), table_end - sizeof(huffman::Header));
+        }
+    }
+    MPI::COMM_WORLD.Bcast(&container, 1, MPI::INT, MASTER_RANK);
+    auto out = open_output(options);
+    if (!container) {
+        // legacy stream without block index
+        std::ostringstream output;
+        bool intact = true;
+        if (rank == MASTER_RANK) {
+            auto is = std::istringstream{read_master(in, 0, in.size)};
+            stats::Timer timer(stats::DECODE, in.size);
+            intact = huffman::decode(is, output);
+            if (!intact) {
+                std::cerr << "malformed Huffman stream\n";
+            }
         }
+        write_master(out, output.str(), rank);
+        close_input(in);
+        close_output(out);
+        stats::report(std::cerr, rank, world_size, MASTER_RANK);
+        MPI::Finalize();
+        return intact;
     }
-    std::string output;
+    int table_size = table.size();
+    MPI::COMM_WORLD.Bcast(&table_size, 1, MPI::INT, MASTER_RANK);
+    table.resize(table_size);
+    MPI::COMM_WORLD.Bcast(table.data(), table_size, MPI::CHAR, MASTER_RANK);
+    MPI::COMM_WORLD.Bcast(&header, sizeof(header), MPI::BYTE, MASTER_RANK);
+    auto table_stream = std::istringstream{table};
+    auto table_decoding = huffman::decoding_table(huffman::decode_table(table_stream, header));
+    // a malformed table leaves every block that uses it undecodable
+    bool intact = static_cast<bool>(table_stream);
+
+    // every rank gets a contiguous range of whole blocks
+    std::vector<size_t> bounds;
     if (rank == MASTER_RANK) {
-        output.resize(displacements.back() + sizes.back());
+        bounds = index_bounds(index, table_end, world_size);
     }
-    MPI::COMM_WORLD.Gatherv(suboutput.data(), suboutput.size(), MPI::CHAR,
-                            output.data(), sizes.data(), displacements.data(), MPI::CHAR,
-                            MASTER_RANK);
-    return output;
+    auto subinput = read_ranges(in, bounds, rank, world_size);
+    bool blocks_intact = true;
+    write_parts(out, decode_blocks(subinput, table_decoding, header, blocks_intact), rank, world_size);
+    intact = intact && blocks_intact;
+    MPI::COMM_WORLD.Allreduce(MPI_IN_PLACE, &intact, 1, MPI::BOOL, MPI::LAND);
+    if (!intact && rank == MASTER_RANK) {
+        std::cerr << "malformed Huffman container\n";
+    }
+    close_input(in);
+    close_output(out);
+    stats::report(std::cerr, rank, world_size, MASTER_RANK);
+    MPI::Finalize();
+    return intact;
+}
+// end snippet mpi_decode_huffman
+// start snippet transfer
+// Every rank has [starts[i], starts[i + 1]) of a whole of 64-bit size; a window of at most
+// CHUNK_SIZE bytes of the whole moves per collective, so counts and displacements stay int
+template<typename Post>
+void chunked(const std::vector<unsigned long long> &starts, int rank, int world_size, Post post) {
+    unsigned long long first = starts.front();
+    unsigned long long last = starts.back();
+    std::vector<int> counts(world_size);
+    std::vector<int> displacements(world_size);
+    for (unsigned long long window = first; window < last; window += CHUNK_SIZE) {
+        unsigned long long window_end = std::min(window + CHUNK_SIZE, last);
+        for (int i = 0; i < world_size; ++i) {
+            unsigned long long lo = std::clamp(starts[i], window, window_end);
+            unsigned long long hi = std::clamp(starts[i + 1], window, window_end);
+            displacements[i] = static_cast<int>(lo - window);
+            counts[i] = static_cast<int>(hi - lo);
+        }
+        post(window - first, counts, displacements,
+             std::clamp(starts[rank], window, window_end) - starts[rank]);
+    }
+}
+
+void start_gatherv(Transfer &transfer, std::string part, int rank, int world_size) {
+    stats::Timer timer(stats::GATHER, part.size());
+    transfer.phase = stats::GATHER;
+    transfer.part = std::move(part);
+    if (hierarchy.enabled) {
+        // done when it returns, wait() has nothing left to do
+        transfer.whole = node_gatherv(transfer.part, rank);
+        return;
+    }
+    unsigned long long size = transfer.part.size();
+    std::vector<unsigned long long> sizes(world_size);
+    MPI::COMM_WORLD.Allgather(&size, 1, MPI::UNSIGNED_LONG_LONG, sizes.data(), 1, MPI::UNSIGNED_LONG_LONG);
+    std::vector<unsigned long long> starts(world_size + 1, 0);
+    for (int i = 0; i < world_size; ++i) {
+        starts[i + 1] = starts[i] + sizes[i];
+    }
+    transfer.whole.clear();
+    if (rank == MASTER_RANK) {
+        transfer.whole.resize(starts.back());
+    }
+    chunked(starts, rank, world_size, [&](size_t window, const std::vector<int> &counts,
+                                          const std::vector<int> &displacements, size_t own) {
+        // non-blocking collectives have no C++ bindings
+        MPI_Request request;
+        MPI_Igatherv(transfer.part.data() + own, counts[rank], MPI_CHAR,
+                     rank == MASTER_RANK ? transfer.whole.data() + window : nullptr,
+                     counts.data(), displacements.data(), MPI_CHAR, MASTER_RANK, MPI_COMM_WORLD, &request);
+        transfer.requests.emplace_back(request);
+    });
+}
+
+// `input` on the master has to outlive the transfer
+void start_scatterv(Transfer &transfer, std::string_view input, const std::vector<size_t> &bounds,
+                    int rank, int world_size) {
+    stats::Timer timer(stats::SCATTER);
+    transfer.phase = stats::SCATTER;
+    std::vector<unsigned long long> starts(world_size + 1);
+    if (rank == MASTER_RANK) {
+        std::copy(bounds.begin(), bounds.end(), starts.begin());
+    }
+    MPI::COMM_WORLD.Bcast(starts.data(), world_size + 1, MPI::UNSIGNED_LONG_LONG, MASTER_RANK);
+    transfer.part.assign(starts[rank + 1] - starts[rank], '\0');
+    timer.bytes = transfer.part.size();
+    chunked(starts, rank, world_size, [&](size_t window, const std::vector<int> &counts,
+                                          const std::vector<int> &displacements, size_t own) {
+        MPI_Request request;
+        MPI_Iscatterv(rank == MASTER_RANK ? input.data() + starts.front() + window : nullptr,
+                      counts.data(), displacements.data(), MPI_CHAR,
+                      transfer.part.data() + own, counts[rank], MPI_CHAR, MASTER_RANK, MPI_COMM_WORLD, &request);
+        transfer.requests.emplace_back(request);
+    });
+}
+
+void wait(Transfer &transfer) {
+    stats::Timer timer(transfer.phase);
+    MPI::Request::Waitall(static_cast<int>(transfer.requests.size()), transfer.requests.data());
+    transfer.requests.clear();
+}
+// end snippet transfer
+// start snippet my_gatherv
+std::string my_gatherv(std::string suboutput, int rank, int world_size) {
+    Transfer transfer;
+    start_gatherv(transfer, std::move(suboutput), rank, world_size);
+    wait(transfer);
+    return std::move(transfer.whole);
 }
 // end snippet my_gatherv
+// start snippet hierarchy
+void init_hierarchy() {
+    int rank = MPI::COMM_WORLD.Get_rank();
+    MPI_Comm node;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+    hierarchy.node = MPI::Intracomm(node);
+    bool leader = hierarchy.node.Get_rank() == 0;
+    hierarchy.leader = leader;
+    hierarchy.leaders = MPI::COMM_WORLD.Split(leader ? 0 : MPI::UNDEFINED, rank);
+    std::vector<int> members(hierarchy.node.Get_size());
+    hierarchy.node.Gather(&rank, 1, MPI::INT, members.data(), 1, MPI::INT, 0);
+    if (leader) {
+        int count = static_cast<int>(members.size());
+        int nodes = hierarchy.leaders.Get_size();
+        std::vector<int> counts(nodes);
+        hierarchy.leaders.Gather(&count, 1, MPI::INT, counts.data(), 1, MPI::INT, 0);
+        std::vector<int> displacements(nodes, 0);
+        for (int i = 1; i < nodes; ++i) {
+            displacements[i] = displacements[i - 1] + counts[i - 1];
+        }
+        hierarchy.order.resize(rank == MASTER_RANK ? MPI::COMM_WORLD.Get_size() : 0);
+        hierarchy.leaders.Gatherv(members.data(), count, MPI::INT,
+                                  hierarchy.order.data(), counts.data(), displacements.data(), MPI::INT, 0);
+    }
+    hierarchy.enabled = true;
+}
+
+// `total` bytes owned by the node leader, every rank of the node writes its own at `offset`
+struct NodeWindow {
+    MPI_Win window = MPI_WIN_NULL;
+    char *all = nullptr;
+    char *own = nullptr;
+
+    NodeWindow(size_t offset, size_t total) {
+        MPI_Win_allocate_shared(static_cast<MPI_Aint>(hierarchy.leader ? total : 0), 1, MPI_INFO_NULL,
+                                hierarchy.node, &all, &window);
+        MPI_Aint size;
+        int unit;
+        MPI_Win_shared_query(window, 0, &size, &unit, &all);
+        own = all + offset;
+        MPI_Win_fence(0, window);
+    }
+    ~NodeWindow() {
+        MPI_Win_free(&window);
+    }
+    // stores of every rank are visible to the others after it
+    void fence() {
+        MPI_Win_fence(0, window);
+    }
+};
+
+// Every rank adds its counts in the node window, leaders reduce across nodes and hand the sum back
+void node_reduce(std::vector<huffman::freq_t> &counts) {
+    size_t bytes = counts.size() * sizeof(huffman::freq_t);
+    NodeWindow shared(hierarchy.node.Get_rank() * bytes, hierarchy.node.Get_size() * bytes);
+    std::memcpy(shared.own, counts.data(), bytes);
+    shared.fence();
+    if (hierarchy.leader) {
+        auto slots = reinterpret_cast<huffman::freq_t*>(shared.all);
+        int node_size = hierarchy.node.Get_size();
+        for (int r = 1; r < node_size; ++r) {
+            for (size_t i = 0; i < counts.size(); ++i) {
+                counts[i] += slots[r * counts.size() + i];
+            }
+        }
+        hierarchy.leaders.Allreduce(MPI_IN_PLACE, counts.data(), static_cast<int>(counts.size()),
+                                    MPI::UNSIGNED_LONG_LONG, MPI::SUM);
+        std::memcpy(shared.all, counts.data(), bytes);
+    }
+    shared.fence();
+    std::memcpy(counts.data(), shared.all, bytes);
+    shared.fence();
+}
+
+// Parts are pooled in the node window, leaders send whole nodes to the master, which puts them in rank order
+std::string node_gatherv(const std::string &part, int rank) {
+    unsigned long long size = part.size();
+    std::vector<unsigned long long> node_sizes(hierarchy.node.Get_size());
+    hierarchy.node.Gather(&size, 1, MPI::UNSIGNED_LONG_LONG, node_sizes.data(), 1, MPI::UNSIGNED_LONG_LONG, 0);
+    unsigned long long offset = 0;
+    hierarchy.node.Exscan(&size, &offset, 1, MPI::UNSIGNED_LONG_LONG, MPI::SUM);
+    unsigned long long total = 0;
+    hierarchy.node.Allreduce(&size, &total, 1, MPI::UNSIGNED_LONG_LONG, MPI::SUM);
+    NodeWindow shared(hierarchy.node.Get_rank() == 0 ? 0 : offset, total);
+    if (!part.empty()) {
+        std::memcpy(shared.own, part.data(), part.size());
+    }
+    shared.fence();
+    std::string whole;
+    if (hierarchy.leader) {
+        int nodes = hierarchy.leaders.Get_size();
+        int leader = hierarchy.leaders.Get_rank();
+        int node_size = static_cast<int>(node_sizes.size());
+        std::vector<int> members(nodes);
+        hierarchy.leaders.Gather(&node_size, 1, MPI::INT, members.data(), 1, MPI::INT, 0);
+        std::vector<int> first(nodes, 0);
+        for (int i = 1; i < nodes; ++i) {
+            first[i] = first[i - 1] + members[i - 1];
+        }
+        std::vector<unsigned long long> sizes(rank == MASTER_RANK ? hierarchy.order.size() : 0);
+        hierarchy.leaders.Gatherv(node_sizes.data(), node_size, MPI::UNSIGNED_LONG_LONG,
+                                  sizes.data(), members.data(), first.data(), MPI::UNSIGNED_LONG_LONG, 0);
+        std::vector<unsigned long long> all_bytes(nodes);
+        hierarchy.leaders.Allgather(&total, 1, MPI::UNSIGNED_LONG_LONG, all_bytes.data(), 1, MPI::UNSIGNED_LONG_LONG);
+        std::vector<unsigned long long> starts(nodes + 1, 0);
+        for (int i = 0; i < nodes; ++i) {
+            starts[i + 1] = starts[i] + all_bytes[i];
+        }
+        std::string pooled(rank == MASTER_RANK ? starts.back() : 0, '\0');
+        std::vector<MPI::Request> requests;
+        chunked(starts, leader, nodes, [&](size_t window, const std::vector<int> &counts,
+                                           const std::vector<int> &displacements, size_t own) {
+            MPI_Request request;
+            MPI_Igatherv(shared.all + own, counts[leader], MPI_CHAR,
+                         rank == MASTER_RANK ? pooled.data() + window : nullptr,
+                         counts.data(), displacements.data(), MPI_CHAR, 0, hierarchy.leaders, &request);
+            requests.emplace_back(request);
+        });
+        MPI::Request::Waitall(static_cast<int>(requests.size()), requests.data());
+        if (rank == MASTER_RANK && std::is_sorted(hierarchy.order.begin(), hierarchy.order.end())) {
+            whole = std::move(pooled); // every node holds a contiguous range of ranks
+        } else if (rank == MASTER_RANK) {
+            // pooled holds the parts in hierarchy.order
+            std::vector<unsigned long long> positions(sizes.size());
+            std::vector<unsigned long long> rank_sizes(sizes.size());
+            unsigned long long position = 0;
+            for (size_t i = 0; i < sizes.size(); ++i) {
+                positions[hierarchy.order[i]] = position;
+                rank_sizes[hierarchy.order[i]] = sizes[i];
+                position += sizes[i];
+            }
+            whole.reserve(pooled.size());
+            for (size_t r = 0; r < sizes.size(); ++r) {
+                whole.append(pooled, positions[r], rank_sizes[r]);
+            }
+        }
+    }
+    shared.fence();
+    return whole;
+}
+// end snippet hierarchy
+// start snippet output
+MPI::File open_file(const char *filename, int amode) {
+    // file errors return silently by default, the opened file inherits this handler
+    MPI::FILE_NULL.Set_errhandler(MPI::ERRORS_ARE_FATAL);
+    return MPI::File::Open(MPI::COMM_WORLD, filename, amode, MPI::INFO_NULL);
+}
+
+Output open_output(const Options &options) {
+    Output out;
+    if (options.output == nullptr) {
+        return out;
+    }
+    out.parallel = true;
+    out.file = open_file(options.output, MPI::MODE_CREATE | MPI::MODE_WRONLY);
+    out.file.Set_size(0);
+    return out;
+}
+
+// Independent non-blocking file access to transfer.part in CHUNK_SIZE pieces
+void start_read_at(Transfer &transfer, MPI::File &file, MPI::Offset offset) {
+    stats::Timer timer(stats::READ, transfer.part.size());
+    transfer.phase = stats::READ;
+    for (size_t done = 0; done < transfer.part.size(); done += CHUNK_SIZE) {
+        int count = static_cast<int>(std::min(transfer.part.size() - done, CHUNK_SIZE));
+        transfer.requests.push_back(file.Iread_at(offset + done, transfer.part.data() + done, count, MPI::CHAR));
+    }
+}
+
+void start_write_at(Transfer &transfer, MPI::File &file, MPI::Offset offset) {
+    stats::Timer timer(stats::WRITE, transfer.part.size());
+    transfer.phase = stats::WRITE;
+    for (size_t done = 0; done < transfer.part.size(); done += CHUNK_SIZE) {
+        int count = static_cast<int>(std::min(transfer.part.size() - done, CHUNK_SIZE));
+        transfer.requests.push_back(file.Iwrite_at(offset + done, transfer.part.data() + done, count, MPI::CHAR));
+    }
+}
+
+// Starts appending the parts of all ranks in rank order, returns the offset of this rank's part.
+// The master prints the gathered parts in finish_write, so writes finish in the order they start.
+MPI::Offset start_write(Transfer &transfer, Output &out, std::string part, int rank, int world_size) {
+    unsigned long long size = part.size();
+    unsigned long long offset = 0;
+    MPI::COMM_WORLD.Exscan(&size, &offset, 1, MPI::UNSIGNED_LONG_LONG, MPI::SUM);
+    if (rank == 0) {
+        offset = 0; // Exscan leaves it undefined
+    }
+    MPI::Offset start = out.size + static_cast<MPI::Offset>(offset);
+    if (out.parallel) {
+        transfer.part = std::move(part);
+        start_write_at(transfer, out.file, start);
+    } else {
+        start_gatherv(transfer, std::move(part), rank, world_size);
+    }
+    unsigned long long total = offset + size;
+    MPI::COMM_WORLD.Bcast(&total, 1, MPI::UNSIGNED_LONG_LONG, world_size - 1);
+    out.size += static_cast<MPI::Offset>(total);
+    return start;
+}
+
+void finish_write(Transfer &transfer, const Output &out, int rank) {
+    wait(transfer);
+    if (!out.parallel && rank == MASTER_RANK) {
+        stats::Timer timer(stats::WRITE, transfer.whole.size());
+        std::cout << transfer.whole;
+    }
+    transfer.part.clear();
+    transfer.whole.clear();
+}
+
+MPI::Offset write_parts(Output &out, std::string part, int rank, int world_size) {
+    Transfer transfer;
+    auto start = start_write(transfer, out, std::move(part), rank, world_size);
+    finish_write(transfer, out, rank);
+    return start;
+}
+
+// Headers and trailers only the master has
+void write_master(Output &out, const std::string &data, int rank) {
+    unsigned long long size = data.size();
+    MPI::COMM_WORLD.Bcast(&size, 1, MPI::UNSIGNED_LONG_LONG, MASTER_RANK);
+    if (rank == MASTER_RANK) {
+        if (out.parallel) {
+            Transfer transfer;
+            transfer.part = data;
+            start_write_at(transfer, out.file, out.size);
+            wait(transfer);
+        } else {
+            stats::Timer timer(stats::WRITE, data.size());
+            std::cout << data;
+        }
+    }
+    out.size += static_cast<MPI::Offset>(size);
+}
+
+void close_output(Output &out) {
+    if (out.parallel) {
+        out.file.Close();
+    }
+}
+
+// Index entries of all ranks on `root`, ordered by offset
+huffman::Index gather_index(const huffman::Index &index, int root, int rank, int world_size) {
+    stats::Timer timer(stats::GATHER, index.size() * sizeof(huffman::BlockIndex));
+    int index_size = index.size() * sizeof(huffman::BlockIndex);
+    std::vector<int> sizes(world_size);
+    MPI::COMM_WORLD.Gather(&index_size, 1, MPI::INT, sizes.data(), 1, MPI::INT, root);
+    std::vector<int> displacements(world_size, 0);
+    for (int i = 1; i < world_size; ++i) {
+        displacements[i] = displacements[i - 1] + sizes[i - 1];
+    }
+    huffman::Index all_index;
+    if (rank == root) {
+        all_index.resize((displacements.back() + sizes.back()) / sizeof(huffman::BlockIndex));
+    }
+    MPI::COMM_WORLD.Gatherv(index.data(), index_size, MPI::BYTE,
+                            all_index.data(), sizes.data(), displacements.data(), MPI::BYTE, root);
+    std::sort(all_index.begin(), all_index.end(), [](const huffman::BlockIndex &a, const huffman::BlockIndex &b) {
+        return a.offset < b.offset;
+    });
+    return all_index;
+}
+// end snippet output
+// start snippet scatter_ranges
+// Rank i gets input[bounds[i], bounds[i + 1]), bounds are only needed on the master
+std::string scatter_ranges(std::string_view input, const std::vector<size_t> &bounds, int rank, int world_size) {
+    Transfer transfer;
+    start_scatterv(transfer, input, bounds, rank, world_size);
+    wait(transfer);
+    return std::move(transfer.part);
+}
+// end snippet scatter_ranges
+// start snippet input
+Input open_input(const char *filename, int rank) {
+    Input in;
+    if (filename == nullptr) {
+        if (rank == MASTER_RANK) {
+            stats::Timer timer(stats::READ);
+            in.source = MappedFile(STDIN_FILENO);
+            timer.bytes = in.data().size();
+            in.size = static_cast<MPI::Offset>(in.data().size());
+        }
+        return in;
+    }
+    in.parallel = true;
+    in.file = open_file(filename, MPI::MODE_RDONLY);
+    in.size = in.file.Get_size();
+    return in;
+}
+
+// Headers and trailers, master only
+std::string read_master(Input &in, MPI::Offset offset, size_t length) {
+    if (!in.parallel) {
+        return std::string(in.data().substr(offset, length));
+    }
+    Transfer transfer;
+    transfer.part.assign(length, '\0');
+    start_read_at(transfer, in.file, offset);
+    wait(transfer);
+    return std::move(transfer.part);
+}
+
+// Rank i gets [bounds[i], bounds[i + 1]) of the input, bounds are only needed on the master
+std::string read_ranges(Input &in, const std::vector<size_t> &bounds, int rank, int world_size) {
+    if (!in.parallel) {
+        return scatter_ranges(in.data(), bounds, rank, world_size);
+    }
+    std::vector<unsigned long long> ranges;
+    if (rank == MASTER_RANK) {
+        for (int i = 0; i < world_size; ++i) {
+            ranges.push_back(bounds[i]);
+            ranges.push_back(bounds[i + 1]);
+        }
+    }
+    unsigned long long range[2];
+    MPI::COMM_WORLD.Scatter(ranges.data(), 2, MPI::UNSIGNED_LONG_LONG, range, 2, MPI::UNSIGNED_LONG_LONG, MASTER_RANK);
+    std::string subinput(range[1] - range[0], '\0');
+    stats::Timer timer(stats::READ, subinput.size());
+    // collective reads in CHUNK_SIZE pieces, ranks with less to read join with empty ones
+    unsigned long long pieces = (subinput.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    MPI::COMM_WORLD.Allreduce(MPI_IN_PLACE, &pieces, 1, MPI::UNSIGNED_LONG_LONG, MPI::MAX);
+    for (size_t i = 0, done = 0; i < pieces; ++i) {
+        int count = static_cast<int>(std::min(subinput.size() - done, CHUNK_SIZE));
+        in.file.Read_at_all(static_cast<MPI::Offset>(range[0] + done), subinput.data() + done, count, MPI::CHAR);
+        done += count;
+    }
+    return subinput;
+}
+
+MPI::Offset round_bytes(int world_size) {
+    return static_cast<MPI::Offset>(world_size) * ROUND_BLOCKS * huffman::PART_SIZE;
+}
+
+// Round `round` holds at most ROUND_BLOCKS blocks per rank,
+// every rank prefetches a contiguous range of whole blocks of it into transfer.part
+void start_round(Transfer &transfer, Input &in, long round, int rank, int world_size) {
+    MPI::Offset position = round * round_bytes(world_size);
+    long round_size = std::min(in.size - position, round_bytes(world_size));
+    long blocks = (round_size + huffman::PART_SIZE - 1) / huffman::PART_SIZE;
+    long first = std::min(blocks * rank / world_size * huffman::PART_SIZE, round_size);
+    long last = std::min(blocks * (rank + 1) / world_size * huffman::PART_SIZE, round_size);
+    transfer.part.assign(last - first, '\0');
+    start_read_at(transfer, in.file, position + first);
+}
+
+// Block index from the trailer of a Huffman container, master only
+huffman::Index read_index(Input &in) {
+    if (!in.parallel) {
+        return huffman::decode_index(in.data());
+    }
+    uint64_t blocks = 0;
+    if (in.size >= static_cast<MPI::Offset>(sizeof(blocks))) {
+        std::memcpy(&blocks, read_master(in, in.size - sizeof(blocks), sizeof(blocks)).data(), sizeof(blocks));
+    }
+    blocks = std::min(blocks, static_cast<uint64_t>(in.size) / sizeof(huffman::BlockIndex));
+    size_t length = std::min(static_cast<uint64_t>(in.size),
+                             sizeof(huffman::Header) + sizeof(blocks) + blocks * sizeof(huffman::BlockIndex));
+    return huffman::decode_index(read_master(in, in.size - length, length));
+}
+
+// True when the indexed blocks follow each other up to the BlockHeader{} and the index at the end of the file
+bool index_complete(const huffman::Index &index, size_t size) {
+    if (index.empty()) {
+        return true;
+    }
+    size_t end = index.front().offset;
+    for (auto &entry : index) {
+        if (entry.offset != end) {
+            return false;
+        }
+        end += sizeof(huffman::BlockHeader) + entry.block.length;
+    }
+    return end + sizeof(huffman::BlockHeader) + index.size() * sizeof(huffman::BlockIndex) + sizeof(uint64_t) == size;
+}
+
+// Offsets of the blocks of a file from `position` on, reading only block heads of at most `max_head` bytes
+template<typename Length>
+std::vector<size_t> block_offsets(Input &in, size_t position, size_t max_head, Length block_length) {
+    std::vector<size_t> offsets;
+    size_t size = in.size;
+    while (position < size) {
+        auto head = read_master(in, position, std::min(size - position, max_head));
+        size_t length = block_length(head.data(), head.size());
+        if (length == 0 || length > size - position) {
+            break;
+        }
+        offsets.push_back(position);
+        position += length;
+    }
+    return offsets;
+}
+
+// Offsets of the blocks of a compact RLE container, master only
+std::vector<size_t> rle_block_offsets(Input &in) {
+    if (!in.parallel) {
+        return rle::block_offsets(in.data().data(), in.data().size(), sizeof(rle::Header));
+    }
+    return block_offsets(in, sizeof(rle::Header), rle::MAX_BLOCK_HEAD, rle::block_length);
+}
+
+void close_input(Input &in) {
+    if (in.parallel) {
+        in.file.Close();
+    }
+}
+// end snippet input
+
+// Moves every bound forward to the nearest block start, or to `end`
+std::vector<size_t> align_bounds(const std::vector<size_t> &bounds, const std::vector<size_t> &offsets, size_t end) {
+    std::vector<size_t> aligned;
+    for (size_t bound : bounds) {
+        auto it = std::lower_bound(offsets.begin(), offsets.end(), bound);
+        aligned.push_back(it == offsets.end() ? end : *it);
+    }
+    aligned.front() = offsets.empty() ? end : offsets.front();
+    aligned.back() = end;
+    return aligned;
+}
 // start snippet my_scatter
-std::pair<std::string, int> my_scatter(std::string input, int world_size, int symbol_bytes) {
-    auto [subinput_size, leftover] = std::div(input.size() / symbol_bytes, world_size);
+std::pair<std::string, int> my_scatter(std::string_view input, int world_size, int symbol_bytes) {
+    auto [subinput_size, leftover] = std::lldiv(input.size() / symbol_bytes, world_size);
     subinput_size *= symbol_bytes;
-    MPI::COMM_WORLD.Bcast(&subinput_size, 1, MPI::INT, MASTER_RANK);
-    std::string subinput;
-    subinput.resize(subinput_size);
-    MPI::COMM_WORLD.Scatter(input.data(),subinput_size, MPI::CHAR,
-                            subinput.data(), subinput_size, MPI::CHAR,
-                            MASTER_RANK);
-    return {subinput, leftover * 2};
+    std::vector<size_t> bounds;
+    for (int i = 0; i <= world_size; ++i) {
+        bounds.push_back(subinput_size * i);
+    }
+    return {scatter_ranges(input, bounds, MPI::COMM_WORLD.Get_rank(), world_size), leftover * symbol_bytes};
 }
 // end snippet my_scatter
+// start snippet parallel_rle
+// Every thread runs `codec` on its own slice of `subinput`, the results are concatenated in order
+template<typename Codec>
+std::string parallel_rle(const std::string &subinput, size_t symbol_bytes, stats::Phase phase, Codec codec) {
+    stats::Timer timer(phase, subinput.size());
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    auto bounds = split(subinput.size(), threads, symbol_bytes);
+    std::vector<std::string> suboutputs(threads);
+#pragma omp parallel for
+    for (int i = 0; i < threads; ++i) {
+        codec(subinput.data() + bounds[i], bounds[i + 1] - bounds[i], suboutputs[i]);
+    }
+    std::string suboutput;
+    for (auto &part : suboutputs) {
+        suboutput += part;
+    }
+    return suboutput;
+}
+// end snippet parallel_rle
 // start snippet mpi_encode_rle
-void mpi_encode_rle() {
-    MPI::Init();
+void mpi_encode_rle(const Options &options) {
+    init_threads(options);
     int rank = MPI::COMM_WORLD.Get_rank();
     int world_size = MPI::COMM_WORLD.Get_size();
 
-    std::string input;
-    if (rank == MASTER_RANK) {
-        input = (std::ostringstream{} << std::cin.rdbuf()).str();
+    auto in = open_input(options.input, rank);
+    auto out = open_output(options);
+    if (options.compact) {
+        encode_rle_compact(in, out, options, rank, world_size);
+        close_input(in);
+        close_output(out);
+        stats::report(std::cerr, rank, world_size, MASTER_RANK);
+        MPI::Finalize();
+        return;
     }
 
-    auto [subinput, leftover] = my_scatter(input, world_size, 1);
-    std::istringstream subinput_stream { subinput };
-    std::ostringstream suboutput_stream;
-    auto stats = rle::encode(subinput_stream, suboutput_stream);
-    std::string output = my_gatherv(suboutput_stream.str(), rank, world_size);
-    if (rank == MASTER_RANK) {
-        std::cout << output;
-        stats.input_size = input.size();
-        stats.output_size = output.size();
+    // ranks read balanced ranges themselves, so there is no leftover for the master
+    std::string subinput;
+    int leftover = 0;
+    if (in.parallel) {
+        subinput = read_ranges(in, split(in.size, world_size, 1), rank, world_size);
+    } else {
+        std::tie(subinput, leftover) = my_scatter(in.data(), world_size, 1);
     }
+    std::string_view input = in.data();
+    std::string suboutput = parallel_rle(subinput, 1, stats::ENCODE, [](const char *data, size_t size, std::string &out) {
+        rle::encode(data, size, out);
+    });
+    write_parts(out, suboutput, rank, world_size);
+    std::string tail;
     if (rank == MASTER_RANK && leftover != 0) {
-        auto is = std::istringstream{ std::string(std::string_view(input).substr(input.size() - leftover, leftover)) };
-        auto x = rle::encode(is, std::cout);
-        stats.input_size += x.input_size;
-        stats.output_size += x.output_size;
+        stats::Timer timer(stats::ENCODE, leftover);
+        rle::encode(input.data() + input.size() - leftover, leftover, tail);
     }
+    write_master(out, tail, rank);
     if (rank == MASTER_RANK) {
         std::cerr
             << "коэффициент сжатия = "
-            << static_cast<double>(stats.output_size) / static_cast<double>(stats.input_size) << '\n';
+            << static_cast<double>(out.size) / static_cast<double>(in.size) << '\n';
     }
+    close_input(in);
+    close_output(out);
+    stats::report(std::cerr, rank, world_size, MASTER_RANK);
     MPI::Finalize();
 }
 // end snippet mpi_encode_rle
 // start snippet mpi_decode_rle
-void mpi_decode_rle() {
-    MPI::Init();
+// False when the compact container is malformed, the intact blocks are still written
+bool mpi_decode_rle(const Options &options) {
+    if (options.streaming) {
+        return stream_decode(options, [](std::istream &is, std::ostream &os) {
+            if (!rle::decode(is, os)) {
+                std::cerr << "malformed compact RLE container\n";
+                return false;
+            }
+            return true;
+        });
+    }
+    init_threads(options);
     int rank = MPI::COMM_WORLD.Get_rank();
     int world_size = MPI::COMM_WORLD.Get_size();
-    std::string input;
+    auto in = open_input(options.input, rank);
+    int compact = 0;
+    rle::Header header{};
     if (rank == MASTER_RANK) {
-        input = (std::ostringstream{} << std::cin.rdbuf()).str();
+        auto head = read_master(in, 0, std::min(static_cast<size_t>(in.size), sizeof(rle::Header)));
+        compact = container::has_magic(head.data(), head.size(), rle::CONTAINER);
+        std::memcpy(&header, head.data(), head.size());
     }
-    auto [subinput, leftover] = my_scatter(input, world_size, 2);
-    std::istringstream subinput_stream { subinput };
-    std::ostringstream suboutput_stream;
-    rle::decode(subinput_stream, suboutput_stream);
-    std::string output = my_gatherv(suboutput_stream.str(), rank, world_size);
-    if (rank == MASTER_RANK) {
-        std::cout << output;
+    MPI::COMM_WORLD.Bcast(&compact, 1, MPI::INT, MASTER_RANK);
+    MPI::COMM_WORLD.Bcast(&header, sizeof(header), MPI::BYTE, MASTER_RANK);
+    auto out = open_output(options);
+    if (compact) {
+        bool intact = decode_rle_compact(in, out, header.flags, rank, world_size);
+        if (!intact && rank == MASTER_RANK) {
+            std::cerr << "malformed compact RLE container\n";
+        }
+        close_input(in);
+        close_output(out);
+        stats::report(std::cerr, rank, world_size, MASTER_RANK);
+        MPI::Finalize();
+        return intact;
+    }
+    // (count, byte) pairs must not be cut
+    std::string subinput;
+    int leftover = 0;
+    if (in.parallel) {
+        subinput = read_ranges(in, split(in.size, world_size, 2), rank, world_size);
+    } else {
+        std::tie(subinput, leftover) = my_scatter(in.data(), world_size, 2);
     }
+    std::string_view input = in.data();
+    std::string suboutput = parallel_rle(subinput, 2, stats::DECODE, [](const char *data, size_t size, std::string &out) {
+        rle::decode(data, size, out);
+    });
+    write_parts(out, suboutput, rank, world_size);
+    std::string tail;
     if (rank == MASTER_RANK && leftover != 0) {
-        auto is = std::istringstream{std::string(std::string_view(input).substr(input.size() - leftover, leftover))};
-        rle::decode(is, std::cout);
+        stats::Timer timer(stats::DECODE, leftover);
+        rle::decode(input.data() + input.size() - leftover, leftover, tail);
     }
+    write_master(out, tail, rank);
+    close_input(in);
+    close_output(out);
+    stats::report(std::cerr, rank, world_size, MASTER_RANK);
     MPI::Finalize();
+    return true;
 }
 // end snippet mpi_decode_rle
-// start snippet mpi_generate
-void mpi_generate() {
-    MPI::Init();
+// start snippet encode_rle_compact
+rle::Header rle_header(const Options &options) {
+    rle::Header header = rle::CONTAINER;
+    if (options.checksums) {
+        header.flags |= rle::CHECKSUMS;
+    }
+    return header;
+}
+
+void encode_rle_compact(Input &in, Output &out, const Options &options, int rank, int world_size) {
+    std::vector<size_t> bounds;
+    if (rank == MASTER_RANK) {
+        bounds = split(in.size, world_size, 1);
+    }
+    auto subinput = read_ranges(in, bounds, rank, world_size);
+    auto header = rle_header(options);
+    write_master(out, std::string(reinterpret_cast<const char*>(&header), sizeof(rle::Header)), rank);
+    write_parts(out, rle_compact_blocks(subinput, header.flags, rank, world_size), rank, world_size);
+    if (rank == MASTER_RANK) {
+        std::cerr
+            << "коэффициент сжатия = "
+            << static_cast<double>(out.size) / static_cast<double>(in.size) << '\n';
+    }
+}
+
+// Blocks of the compact container without its header, runs are stitched across all ranks
+std::string rle_compact_blocks(const std::string &subinput, uint8_t flags, int rank, int world_size) {
+    stats::Timer timer(stats::ENCODE, subinput.size());
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    // every thread slice is a block
+    auto slice_bounds = split(subinput.size(), threads, 1);
+    std::vector<rle::SliceEdges> edges;
+    for (int i = 0; i < threads; ++i) {
+        edges.push_back(rle::slice_edges(subinput.data() + slice_bounds[i], slice_bounds[i + 1] - slice_bounds[i]));
+    }
+    std::vector<int> counts(world_size);
+    MPI::COMM_WORLD.Allgather(&threads, 1, MPI::INT, counts.data(), 1, MPI::INT);
+    std::vector<int> sizes(world_size);
+    std::vector<int> displacements(world_size, 0);
+    for (int i = 0; i < world_size; ++i) {
+        sizes[i] = counts[i] * static_cast<int>(sizeof(rle::SliceEdges));
+        if (i > 0) {
+            displacements[i] = displacements[i - 1] + sizes[i - 1];
+        }
+    }
+    std::vector<rle::SliceEdges> all_edges((displacements.back() + sizes.back()) / sizeof(rle::SliceEdges));
+    MPI::COMM_WORLD.Allgatherv(edges.data(), sizes[rank], MPI::BYTE,
+                               all_edges.data(), sizes.data(), displacements.data(), MPI::BYTE);
+    auto stitches = rle::stitch(all_edges);
+    size_t first_slice = displacements[rank] / sizeof(rle::SliceEdges);
+    std::vector<std::string> blocks(threads);
+#pragma omp parallel for
+    for (int i = 0; i < threads; ++i) {
+        auto [skip, tail] = stitches[first_slice + i];
+        size_t size = slice_bounds[i + 1] - slice_bounds[i];
+        if (size > skip) {
+            rle::encode_block(subinput.data() + slice_bounds[i] + skip, size - skip, tail, blocks[i], flags);
+        }
+    }
+    std::string suboutput;
+    for (auto &block : blocks) {
+        suboutput += block;
+    }
+    return suboutput;
+}
+// end snippet encode_rle_compact
+// start snippet decode_rle_compact
+// True on all ranks when every block of the container is well-formed
+bool decode_rle_compact(Input &in, Output &out, uint8_t flags, int rank, int world_size) {
+    std::vector<size_t> bounds;
+    if (rank == MASTER_RANK) {
+        bounds = align_bounds(split(in.size, world_size, 1), rle_block_offsets(in), in.size);
+    }
+    auto subinput = read_ranges(in, bounds, rank, world_size);
+    bool intact = true;
+    write_parts(out, rle_decode_blocks(subinput, flags, intact), rank, world_size);
+    MPI::COMM_WORLD.Allreduce(MPI_IN_PLACE, &intact, 1, MPI::BOOL, MPI::LAND);
+    return intact;
+}
+
+// `subinput` is a range of whole blocks of the compact container, a malformed block or trailing bytes
+// that are not a block clear `intact`
+std::string rle_decode_blocks(const std::string &subinput, uint8_t flags, bool &intact) {
+    stats::Timer timer(stats::DECODE, subinput.size());
+    auto offsets = rle::block_offsets(subinput.data(), subinput.size(), 0);
+    offsets.push_back(subinput.size());
+    std::vector<std::string> decoded(offsets.size() - 1);
+    std::vector<char> consumed(decoded.size());
+#pragma omp parallel for schedule(dynamic)
+    for (long i = 0; i < static_cast<long>(decoded.size()); ++i) {
+        size_t length = rle::decode_block(subinput.data() + offsets[i], subinput.size() - offsets[i], decoded[i], flags);
+        consumed[i] = length != 0 && offsets[i] + length == offsets[i + 1];
+    }
+    intact = std::all_of(consumed.begin(), consumed.end(), [](char ok) { return ok; })
+        && (decoded.size() != 0 || subinput.empty());
+    std::string suboutput;
+    for (auto &block : decoded) {
+        suboutput += block;
+    }
+    return suboutput;
+}
+// end snippet decode_rle_compact
+// start snippet mpi_verify
+// Round trip without the round trip: every rank decodes its own blocks in memory and checks them
+// against their CRC32C, the master reports the corrupted ones. True when all blocks are intact
+bool mpi_verify(const Options &options) {
+    init_threads(options);
     int rank = MPI::COMM_WORLD.Get_rank();
     int world_size = MPI::COMM_WORLD.Get_size();
-    std::mt19937 gen{std::random_device{}()};
-    std::string alphabet;
+    auto in = open_input(options.input, rank);
+    // both containers start with an 8 byte header, the flags follow the magic and the version
+    huffman::Header header{};
+    std::string table;
+    std::vector<size_t> bounds;
+    int kind = 0; // 1 for Huffman, 2 for compact RLE, 0 when there is nothing to verify
     if (rank == MASTER_RANK) {
-        alphabet = (std::ostringstream{} << std::cin.rdbuf()).str();
+        auto head = read_master(in, 0, std::min(static_cast<size_t>(in.size), sizeof(header)));
+        std::memcpy(&header, head.data(), head.size());
+        if (container::has_magic(head.data(), head.size(), huffman::CONTAINER) && (header.flags & huffman::CHECKSUMS)) {
+            kind = 1;
+            auto index = read_index(in);
+            size_t table_end = index.empty() ? in.size : index.front().offset;
+            table = read_master(in, sizeof(header), table_end - sizeof(header));
+            bounds = index_bounds(index, table_end, world_size);
+        } else if (container::has_magic(head.data(), head.size(), rle::CONTAINER) && (header.flags & rle::CHECKSUMS)) {
+            kind = 2;
+            bounds = align_bounds(split(in.size, world_size, 1), rle_block_offsets(in), in.size);
+        } else {
+            std::cerr << "not a Huffman or compact RLE container with checksums\n";
+        }
+    }
+    MPI::COMM_WORLD.Bcast(&kind, 1, MPI::INT, MASTER_RANK);
+    if (kind == 0) {
+        close_input(in);
+        MPI::Finalize();
+        return false;
+    }
+    MPI::COMM_WORLD.Bcast(&header, sizeof(header), MPI::BYTE, MASTER_RANK);
+    int table_size = table.size();
+    MPI::COMM_WORLD.Bcast(&table_size, 1, MPI::INT, MASTER_RANK);
+    table.resize(table_size);
+    MPI::COMM_WORLD.Bcast(table.data(), table_size, MPI::CHAR, MASTER_RANK);
+    auto subinput = read_ranges(in, bounds, rank, world_size);
+
+    // (block number, offset) of the corrupted blocks, both local to the rank
+    size_t blocks = 0;
+    auto corrupted = kind == 1 ? verify_huffman(subinput, table, header, blocks) : verify_rle(subinput, blocks);
+    unsigned long long counts[2] = {blocks, corrupted.size()};
+    std::vector<unsigned long long> all_counts(2 * world_size);
+    MPI::COMM_WORLD.Gather(counts, 2, MPI::UNSIGNED_LONG_LONG, all_counts.data(), 2, MPI::UNSIGNED_LONG_LONG, MASTER_RANK);
+    std::vector<int> sizes(world_size);
+    std::vector<int> displacements(world_size, 0);
+    for (int i = 0; i < world_size; ++i) {
+        sizes[i] = static_cast<int>(all_counts[2 * i + 1]);
+        if (i > 0) {
+            displacements[i] = displacements[i - 1] + sizes[i - 1];
+        }
+    }
+    std::vector<unsigned long long> all_corrupted(rank == MASTER_RANK ? displacements.back() + sizes.back() : 0);
+    MPI::COMM_WORLD.Gatherv(corrupted.data(), static_cast<int>(corrupted.size()), MPI::UNSIGNED_LONG_LONG,
+                            all_corrupted.data(), sizes.data(), displacements.data(), MPI::UNSIGNED_LONG_LONG,
+                            MASTER_RANK);
+    int intact = 1;
+    if (rank == MASTER_RANK) {
+        unsigned long long first_block = 0;
+        unsigned long long total = 0;
+        for (int i = 0; i < world_size; ++i) {
+            for (int j = displacements[i]; j < displacements[i] + sizes[i]; ++j) {
+                if (j % 2 == 0) {
+                    std::cerr
+                        << "corrupted block " << first_block + all_corrupted[j]
+                        << " at offset " << bounds[i] + all_corrupted[j + 1] << '\n';
+                }
+            }
+            first_block += all_counts[2 * i];
+            total += all_counts[2 * i + 1] / 2;
+        }
+        std::cerr << "verified " << first_block << " blocks, " << total << " corrupted\n";
+        intact = total == 0;
+    }
+    MPI::COMM_WORLD.Bcast(&intact, 1, MPI::INT, MASTER_RANK);
+    close_input(in);
+    stats::report(std::cerr, rank, world_size, MASTER_RANK);
+    MPI::Finalize();
+    return intact;
+}
+
+// `subinput` is a range of whole blocks with their headers, returns (block, offset) pairs of the corrupted ones
+std::vector<unsigned long long> verify_huffman(const std::string &subinput, const std::string &table,
+                                               const huffman::Header &header, size_t &blocks) {
+    auto table_stream = std::istringstream{table};
+    auto decoding = huffman::decoding_table(huffman::decode_table(table_stream, header));
+    stats::Timer timer(stats::DECODE, subinput.size());
+    auto index = huffman::index_blocks(subinput, 0);
+    std::vector<char> intact(index.size());
+#pragma omp parallel for schedule(dynamic)
+    for (long i = 0; i < static_cast<long>(index.size()); ++i) {
+        intact[i] = huffman::verify_block(decoding, subinput.data() + index[i].offset + sizeof(huffman::BlockHeader),
+                                          index[i].block, header.flags);
+    }
+    blocks = index.size();
+    std::vector<unsigned long long> corrupted;
+    for (size_t i = 0; i < index.size(); ++i) {
+        if (!intact[i]) {
+            corrupted.insert(corrupted.end(), {i, index[i].offset});
+        }
+    }
+    return corrupted;
+}
+
+std::vector<unsigned long long> verify_rle(const std::string &subinput, size_t &blocks) {
+    stats::Timer timer(stats::DECODE, subinput.size());
+    auto offsets = rle::block_offsets(subinput.data(), subinput.size(), 0);
+    std::vector<char> intact(offsets.size());
+#pragma omp parallel for schedule(dynamic)
+    for (long i = 0; i < static_cast<long>(offsets.size()); ++i) {
+        intact[i] = rle::verify_block(subinput.data() + offsets[i], subinput.size() - offsets[i]);
+    }
+    blocks = offsets.size();
+    std::vector<unsigned long long> corrupted;
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        if (!intact[i]) {
+            corrupted.insert(corrupted.end(), {i, offsets[i]});
+        }
+    }
+    return corrupted;
+}
+// end snippet mpi_verify
+// start snippet mpi_encode_ans
+// Same two passes and container layout as mpi_encode_huffman, only the table and the block bodies differ
+void mpi_encode_ans(const char *filename, const Options &options) {
+    init_threads(options);
+    int rank = MPI::COMM_WORLD.Get_rank();
+    int world_size = MPI::COMM_WORLD.Get_size();
+    auto in = open_input(filename, rank);
+    auto counts = options.dynamic ? histogram_dynamic(in, rank) : histogram_rounds(in, rank, world_size);
+    reduce_histogram(counts);
+    ans::Normalized normalized;
+    ans::EncodingTable table;
+    {
+        stats::Timer timer(stats::CODING);
+        normalized = ans::normalize(counts.data());
+        table = ans::encoding_table(normalized);
+    }
+
+    auto out = open_output(options);
+    std::ostringstream head;
+    if (rank == MASTER_RANK) {
+        head.write(reinterpret_cast<const char*>(&ans::CONTAINER), sizeof(ans::Header));
+        ans::encode_table(head, normalized);
+    }
+    write_master(out, head.str(), rank);
+    auto encode = [&](const std::string &part) {
+        return ans_encode_blocks(part, table);
+    };
+    if (options.dynamic) {
+        encode_dynamic(in, out, rank, world_size, encode);
     } else {
-        alphabet.resize(ALPHABET_SIZE);
+        encode_rounds(in, out, rank, world_size, encode);
     }
-    MPI::COMM_WORLD.Bcast(alphabet.data(), ALPHABET_SIZE, MPI::CHAR, MASTER_RANK);
-    std::stringstream result;
-    generate_file(alphabet, huffman::PART_SIZE, result, gen);
-    std::string output;
     if (rank == MASTER_RANK) {
-        output.resize(world_size * huffman::PART_SIZE);
+        double bits = 0;
+        for (int symbol = 0; symbol < 0x100; ++symbol) {
+            if (counts[symbol] != 0) {
+                bits += static_cast<double>(counts[symbol]) * (ans::TABLE_LOG - std::log2(normalized[symbol]));
+            }
+        }
+        std::cerr
+            << "цена кодирования = " << bits / static_cast<double>(in.size) << '\n'
+            << "коэффициент сжатия = "
+            << static_cast<double>(out.size) / static_cast<double>(in.size) << '\n';
+    }
+    close_input(in);
+    close_output(out);
+    stats::report(std::cerr, rank, world_size, MASTER_RANK);
+    MPI::Finalize();
+}
+
+std::string ans_encode_blocks(const std::string &subinput, const ans::EncodingTable &table) {
+    stats::Timer timer(stats::ENCODE, subinput.size());
+    long blocks = (static_cast<long>(subinput.size()) + huffman::PART_SIZE - 1) / huffman::PART_SIZE;
+    std::vector<std::string> encoded(blocks);
+#pragma omp parallel for schedule(dynamic)
+    for (long i = 0; i < blocks; ++i) {
+        size_t size = std::min(subinput.size() - i * huffman::PART_SIZE, static_cast<size_t>(huffman::PART_SIZE));
+        ans::encode_block(subinput.data() + i * huffman::PART_SIZE, size, encoded[i], table);
+    }
+    std::string suboutput;
+    for (auto &block : encoded) {
+        suboutput += block;
+    }
+    return suboutput;
+}
+// end snippet mpi_encode_ans
+// start snippet mpi_decode_ans
+// False when the input is not an ANS container or a block is malformed, the intact blocks are still written
+bool mpi_decode_ans(const Options &options) {
+    init_threads(options);
+    int rank = MPI::COMM_WORLD.Get_rank();
+    int world_size = MPI::COMM_WORLD.Get_size();
+    auto in = open_input(options.input, rank);
+    huffman::Index index;
+    std::string table;
+    std::vector<size_t> bounds;
+    int container = 0;
+    bool intact = true;
+    size_t table_rest = 0; // bytes after the table up to the first block or the end, master only
+    if (rank == MASTER_RANK) {
+        auto head = read_master(in, 0, std::min(static_cast<size_t>(in.size), sizeof(ans::Header)));
+        size_t table_end = sizeof(ans::Header);
+        container = container::has_magic(head.data(), head.size(), ans::CONTAINER);
+        if (!container) {
+            std::cerr << "not an ANS container\n";
+        } else {
+            // a cut file has no index, then the table has to be the whole rest of an empty container
+            index = read_index(in);
+            intact = index_complete(index, in.size);
+            table_end = index.empty() ? in.size : index.front().offset;
+            table_rest = index.empty() ? sizeof(huffman::BlockHeader) + sizeof(uint64_t) : 0;
+            table = read_master(in, sizeof(ans::Header), table_end - sizeof(ans::Header));
+        }
+        bounds = index_bounds(index, table_end, world_size);
+    }
+    MPI::COMM_WORLD.Bcast(&container, 1, MPI::INT, MASTER_RANK);
+    int table_size = table.size();
+    MPI::COMM_WORLD.Bcast(&table_size, 1, MPI::INT, MASTER_RANK);
+    table.resize(table_size);
+    MPI::COMM_WORLD.Bcast(table.data(), table_size, MPI::CHAR, MASTER_RANK);
+    auto table_stream = std::istringstream{table};
+    auto decoding = ans::decoding_table(ans::decode_table(table_stream));
+    // a malformed table leaves every block undecodable
+    if (container && rank == MASTER_RANK) {
+        intact = intact && table_stream && table.size() - static_cast<size_t>(table_stream.tellg()) == table_rest;
+    }
+
+    auto out = open_output(options);
+    auto subinput = read_ranges(in, bounds, rank, world_size);
+    bool blocks_intact = true;
+    write_parts(out, ans_decode_blocks(subinput, decoding, blocks_intact), rank, world_size);
+    intact = intact && blocks_intact;
+    MPI::COMM_WORLD.Allreduce(MPI_IN_PLACE, &intact, 1, MPI::BOOL, MPI::LAND);
+    if (!intact && rank == MASTER_RANK) {
+        std::cerr << "malformed ANS container\n";
+    }
+    close_input(in);
+    close_output(out);
+    stats::report(std::cerr, rank, world_size, MASTER_RANK);
+    MPI::Finalize();
+    return container && intact;
+}
+
+// `subinput` is a range of whole blocks with their headers, a malformed block clears `intact`
+std::string ans_decode_blocks(const std::string &subinput, const ans::DecodingTable &table, bool &intact) {
+    stats::Timer timer(stats::DECODE, subinput.size());
+    auto blocks = huffman::index_blocks(subinput, 0);
+    std::vector<std::string> decoded(blocks.size());
+    std::vector<char> complete(blocks.size());
+#pragma omp parallel for schedule(dynamic)
+    for (long i = 0; i < static_cast<long>(blocks.size()); ++i) {
+        size_t body = blocks[i].offset + sizeof(huffman::BlockHeader);
+        if (blocks[i].block.length > subinput.size() - body) {
+            continue;
+        }
+        decoded[i].resize(blocks[i].block.symbols);
+        size_t produced = ans::decode_block(table, subinput.data() + body, blocks[i].block.length,
+                                            blocks[i].block.symbols, decoded[i].data());
+        complete[i] = produced == blocks[i].block.symbols;
+        if (!complete[i]) {
+            decoded[i].clear();
+        }
+    }
+    // the last block ends with the range
+    size_t blocks_end = blocks.empty() ? 0 : blocks.back().offset + sizeof(huffman::BlockHeader) + blocks.back().block.length;
+    intact = std::all_of(complete.begin(), complete.end(), [](char ok) { return ok; }) && blocks_end == subinput.size();
+    std::string suboutput;
+    for (auto &block : decoded) {
+        suboutput += block;
+    }
+    return suboutput;
+}
+// end snippet mpi_decode_ans
+// start snippet mpi_encode_lzw
+// Every LZW block starts with an empty dictionary, so ranks and their threads encode whole blocks independently
+void mpi_encode_lzw(const Options &options) {
+    init_threads(options);
+    int rank = MPI::COMM_WORLD.Get_rank();
+    int world_size = MPI::COMM_WORLD.Get_size();
+    auto in = open_input(options.input, rank);
+    auto out = open_output(options);
+    write_master(out, std::string(reinterpret_cast<const char*>(&lzw::CONTAINER), sizeof(lzw::Header)), rank);
+    if (options.dynamic && in.parallel) {
+        // a task is a block, ranks read them from the file themselves
+        Tasks tasks;
+        long first_task = 0;
+        run_tasks(in, lzw::BLOCK_SIZE, static_cast<long>(WINDOW_TASKS) * world_size, rank,
+                  [&](long task, const std::string &part) {
+            tasks[task] = lzw_encode_blocks(part);
+        }, [&](long end_task) {
+            write_tasks(out, tasks, first_task, end_task, rank, world_size);
+            tasks.clear();
+            first_task = end_task;
+        });
+    } else {
+        std::vector<size_t> bounds;
+        if (rank == MASTER_RANK) {
+            bounds = split(in.size, world_size, lzw::BLOCK_SIZE);
+        }
+        auto subinput = read_ranges(in, bounds, rank, world_size);
+        write_parts(out, lzw_encode_blocks(subinput), rank, world_size);
+    }
+    if (rank == MASTER_RANK) {
+        std::cerr
+            << "коэффициент сжатия = "
+            << static_cast<double>(out.size) / static_cast<double>(in.size) << '\n';
+    }
+    close_input(in);
+    close_output(out);
+    stats::report(std::cerr, rank, world_size, MASTER_RANK);
+    MPI::Finalize();
+}
+
+std::string lzw_encode_blocks(const std::string &subinput) {
+    stats::Timer timer(stats::ENCODE, subinput.size());
+    long blocks = (static_cast<long>(subinput.size()) + lzw::BLOCK_SIZE - 1) / lzw::BLOCK_SIZE;
+    std::vector<std::string> encoded(blocks);
+#pragma omp parallel for schedule(dynamic)
+    for (long i = 0; i < blocks; ++i) {
+        size_t size = std::min(subinput.size() - i * lzw::BLOCK_SIZE, lzw::BLOCK_SIZE);
+        lzw::encode_block(subinput.data() + i * lzw::BLOCK_SIZE, size, encoded[i]);
+    }
+    std::string suboutput;
+    for (auto &block : encoded) {
+        suboutput += block;
+    }
+    return suboutput;
+}
+// end snippet mpi_encode_lzw
+// start snippet mpi_decode_lzw
+// False when the input is not an LZW container or a block is malformed, the intact blocks are still written
+bool mpi_decode_lzw(const Options &options) {
+    init_threads(options);
+    int rank = MPI::COMM_WORLD.Get_rank();
+    int world_size = MPI::COMM_WORLD.Get_size();
+    auto in = open_input(options.input, rank);
+    auto out = open_output(options);
+    int container = 0;
+    std::vector<size_t> bounds;
+    if (rank == MASTER_RANK) {
+        auto head = read_master(in, 0, std::min(static_cast<size_t>(in.size), sizeof(lzw::Header)));
+        container = container::has_magic(head.data(), head.size(), lzw::CONTAINER);
+        std::vector<size_t> offsets;
+        if (!container) {
+            std::cerr << "not an LZW container\n";
+        } else if (in.parallel) {
+            offsets = block_offsets(in, sizeof(lzw::Header), sizeof(lzw::BlockHeader), lzw::block_length);
+        } else {
+            offsets = lzw::block_offsets(in.data().data(), in.data().size(), sizeof(lzw::Header));
+        }
+        if (container && offsets.empty()) {
+            // bytes after the header that are not a block still go to a rank, which rejects them
+            offsets.push_back(sizeof(lzw::Header));
+        }
+        bounds = align_bounds(split(in.size, world_size, 1), offsets, in.size);
+    }
+    MPI::COMM_WORLD.Bcast(&container, 1, MPI::INT, MASTER_RANK);
+    auto subinput = read_ranges(in, bounds, rank, world_size);
+    bool intact = true;
+    write_parts(out, lzw_decode_blocks(subinput, intact), rank, world_size);
+    MPI::COMM_WORLD.Allreduce(MPI_IN_PLACE, &intact, 1, MPI::BOOL, MPI::LAND);
+    if (!intact && rank == MASTER_RANK) {
+        std::cerr << "malformed LZW container\n";
+    }
+    close_input(in);
+    close_output(out);
+    stats::report(std::cerr, rank, world_size, MASTER_RANK);
+    MPI::Finalize();
+    return container && intact;
+}
+
+// `subinput` is a range of whole blocks with their headers, a malformed block or trailing bytes
+// that are not a block clear `intact`
+std::string lzw_decode_blocks(const std::string &subinput, bool &intact) {
+    stats::Timer timer(stats::DECODE, subinput.size());
+    auto offsets = lzw::block_offsets(subinput.data(), subinput.size(), 0);
+    offsets.push_back(subinput.size());
+    std::vector<std::string> decoded(offsets.size() - 1);
+    std::vector<char> consumed(decoded.size());
+#pragma omp parallel for schedule(dynamic)
+    for (long i = 0; i < static_cast<long>(decoded.size()); ++i) {
+        size_t length = lzw::decode_block(subinput.data() + offsets[i], subinput.size() - offsets[i], decoded[i]);
+        consumed[i] = length != 0 && offsets[i] + length == offsets[i + 1];
+    }
+    intact = std::all_of(consumed.begin(), consumed.end(), [](char ok) { return ok; })
+        && (decoded.size() != 0 || subinput.empty());
+    std::string suboutput;
+    for (auto &block : decoded) {
+        suboutput += block;
+    }
+    return suboutput;
+}
+// end snippet mpi_decode_lzw
+// Comma-separated list of stages, e.g. rle,huffman and decode_huffman,decode_rle to undo it
+bool parse_stages(const char *list, std::vector<std::string> &stages) {
+    std::istringstream is {list};
+    for (std::string stage; std::getline(is, stage, ','); ) {
+        if (stage != "rle" && stage != "huffman" && stage != "decode_rle" && stage != "decode_huffman") {
+            std::cerr << "unknown stage " << stage << '\n';
+            return false;
+        }
+        stages.push_back(stage);
+    }
+    return !stages.empty();
+}
+
+// start snippet mpi_pipeline
+// Every rank keeps its slice between the stages, only the final output goes through the master.
+// False when a decode stage finds its container malformed, the later stages still run on the intact blocks
+bool mpi_pipeline(const std::vector<std::string> &stages, const Options &options) {
+    init_threads(options);
+    int rank = MPI::COMM_WORLD.Get_rank();
+    int world_size = MPI::COMM_WORLD.Get_size();
+    auto in = open_input(options.input, rank);
+    std::vector<size_t> bounds;
+    if (rank == MASTER_RANK) {
+        bounds = split(in.size, world_size, 1);
+    }
+    std::string buffer = read_ranges(in, bounds, rank, world_size);
+    bool intact = true;
+    for (auto &stage : stages) {
+        unsigned long long sizes[2] = {buffer.size(), 0};
+        if (stage == "rle") {
+            buffer = pipeline_rle(buffer, options, rank, world_size);
+        } else if (stage == "huffman") {
+            buffer = pipeline_huffman(buffer, options, rank, world_size);
+        } else if (stage == "decode_rle") {
+            buffer = pipeline_decode_rle(buffer, rank, world_size, intact);
+        } else {
+            buffer = pipeline_decode_huffman(buffer, rank, world_size, intact);
+        }
+        sizes[1] = buffer.size();
+        unsigned long long totals[2];
+        MPI::COMM_WORLD.Reduce(sizes, totals, 2, MPI::UNSIGNED_LONG_LONG, MPI::SUM, MASTER_RANK);
+        if (rank == MASTER_RANK) {
+            std::cerr
+                << stage << ": коэффициент сжатия = "
+                << static_cast<double>(totals[1]) / static_cast<double>(totals[0]) << '\n';
+        }
+    }
+    auto out = open_output(options);
+    write_parts(out, buffer, rank, world_size);
+    if (rank == MASTER_RANK) {
+        std::cerr
+            << "суммарный коэффициент сжатия = "
+            << static_cast<double>(out.size) / static_cast<double>(in.size) << '\n';
+    }
+    close_input(in);
+    close_output(out);
+    stats::report(std::cerr, rank, world_size, MASTER_RANK);
+    MPI::Finalize();
+    return intact;
+}
+// end snippet mpi_pipeline
+
+std::string pipeline_rle(const std::string &buffer, const Options &options, int rank, int world_size) {
+    if (!options.compact) {
+        return parallel_rle(buffer, 1, stats::ENCODE, [](const char *data, size_t size, std::string &out) {
+            rle::encode(data, size, out);
+        });
+    }
+    auto header = rle_header(options);
+    std::string blocks = rle_compact_blocks(buffer, header.flags, rank, world_size);
+    if (rank == MASTER_RANK) {
+        blocks.insert(0, reinterpret_cast<const char*>(&header), sizeof(rle::Header));
+    }
+    return blocks;
+}
+
+// The master's slice opens the container and the last rank's slice closes it with the index
+std::string pipeline_huffman(const std::string &buffer, const Options &options, int rank, int world_size) {
+    std::vector<huffman::freq_t> counts(0x100);
+    huffman::Coding global{};
+    if (options.tables != Tables::LOCAL) {
+        histogram_blocks(buffer, counts.data());
+        reduce_histogram(counts);
+        global = make_coding(counts, options);
+    }
+    auto [coding, apriori, longest] = global;
+    auto header = make_header(options);
+    std::ostringstream head;
+    head.write(reinterpret_cast<const char*>(&header), sizeof(huffman::Header));
+    huffman::encode_table(head, coding, header);
+    std::string blocks = encode_blocks(buffer, huffman::code_table(coding), longest, options);
+
+    unsigned long long size = blocks.size();
+    unsigned long long offset = 0;
+    MPI::COMM_WORLD.Exscan(&size, &offset, 1, MPI::UNSIGNED_LONG_LONG, MPI::SUM);
+    if (rank == 0) {
+        offset = 0;
+    }
+    auto index = huffman::index_blocks(blocks, offset + head.tellp());
+    int last = world_size - 1;
+    auto all_index = gather_index(index, last, rank, world_size);
+    std::string result;
+    if (rank == 0) {
+        result = head.str();
+    }
+    result += blocks;
+    if (rank == last) {
+        std::ostringstream tail;
+        huffman::encode_index(tail, all_index);
+        result += tail.str();
+    }
+    return result;
+}
+
+// The slices of an encode stage end anywhere, so a decode stage gathers them on the master
+// to cut them again on block boundaries, the same bounds mpi_decode_rle uses for a file
+std::string pipeline_decode_rle(const std::string &buffer, int rank, int world_size, bool &intact) {
+    std::string whole = my_gatherv(buffer, rank, world_size);
+    int compact = 0;
+    rle::Header header{};
+    std::vector<size_t> bounds;
+    if (rank == MASTER_RANK) {
+        compact = container::has_magic(whole.data(), whole.size(), rle::CONTAINER);
+        if (compact) {
+            std::memcpy(&header, whole.data(), sizeof(rle::Header));
+            auto offsets = rle::block_offsets(whole.data(), whole.size(), sizeof(rle::Header));
+            bounds = align_bounds(split(whole.size(), world_size, 1), offsets, whole.size());
+        } else {
+            // (count, byte) pairs must not be cut
+            bounds = split(whole.size(), world_size, 2);
+        }
+    }
+    MPI::COMM_WORLD.Bcast(&compact, 1, MPI::INT, MASTER_RANK);
+    MPI::COMM_WORLD.Bcast(&header, sizeof(header), MPI::BYTE, MASTER_RANK);
+    auto subinput = scatter_ranges(whole, bounds, rank, world_size);
+    if (!compact) {
+        return parallel_rle(subinput, 2, stats::DECODE, [](const char *data, size_t size, std::string &out) {
+            rle::decode(data, size, out);
+        });
+    }
+    bool blocks_intact = true;
+    std::string suboutput = rle_decode_blocks(subinput, header.flags, blocks_intact);
+    MPI::COMM_WORLD.Allreduce(MPI_IN_PLACE, &blocks_intact, 1, MPI::BOOL, MPI::LAND);
+    if (!blocks_intact && rank == MASTER_RANK) {
+        std::cerr << "malformed compact RLE container\n";
+    }
+    intact = intact && blocks_intact;
+    return suboutput;
+}
+
+// Regathers the slices like pipeline_decode_rle, every rank then gets whole blocks of the index
+std::string pipeline_decode_huffman(const std::string &buffer, int rank, int world_size, bool &intact) {
+    std::string whole = my_gatherv(buffer, rank, world_size);
+    int container = 0;
+    huffman::Header header{};
+    std::string table;
+    std::vector<size_t> bounds;
+    if (rank == MASTER_RANK) {
+        container = container::has_magic(whole.data(), whole.size(), huffman::CONTAINER);
+        if (container) {
+            std::memcpy(&header, whole.data(), sizeof(huffman::Header));
+            auto index = huffman::decode_index(whole);
+            size_t table_end = index.empty() ? whole.size() : index.front().offset;
+            table = whole.substr(sizeof(huffman::Header), table_end - sizeof(huffman::Header));
+            bounds = index_bounds(index, table_end, world_size);
+        }
+    }
+    MPI::COMM_WORLD.Bcast(&container, 1, MPI::INT, MASTER_RANK);
+    if (!container) {
+        // legacy stream without block index, the master decodes it alone
+        std::ostringstream output;
+        bool stream_intact = true;
+        if (rank == MASTER_RANK) {
+            auto is = std::istringstream{whole};
+            stats::Timer timer(stats::DECODE, whole.size());
+            stream_intact = huffman::decode(is, output);
+        }
+        MPI::COMM_WORLD.Bcast(&stream_intact, 1, MPI::BOOL, MASTER_RANK);
+        if (!stream_intact && rank == MASTER_RANK) {
+            std::cerr << "malformed Huffman stream\n";
+        }
+        intact = intact && stream_intact;
+        return output.str();
+    }
+    int table_size = table.size();
+    MPI::COMM_WORLD.Bcast(&table_size, 1, MPI::INT, MASTER_RANK);
+    table.resize(table_size);
+    MPI::COMM_WORLD.Bcast(table.data(), table_size, MPI::CHAR, MASTER_RANK);
+    MPI::COMM_WORLD.Bcast(&header, sizeof(header), MPI::BYTE, MASTER_RANK);
+    auto table_stream = std::istringstream{table};
+    auto table_decoding = huffman::decoding_table(huffman::decode_table(table_stream, header));
+    bool blocks_intact = static_cast<bool>(table_stream);
+    auto subinput = scatter_ranges(whole, bounds, rank, world_size);
+    bool decoded_intact = true;
+    std::string suboutput = decode_blocks(subinput, table_decoding, header, decoded_intact);
+    blocks_intact = blocks_intact && decoded_intact;
+    MPI::COMM_WORLD.Allreduce(MPI_IN_PLACE, &blocks_intact, 1, MPI::BOOL, MPI::LAND);
+    if (!blocks_intact && rank == MASTER_RANK) {
+        std::cerr << "malformed Huffman container\n";
     }
-    MPI::COMM_WORLD.Gather(result.str().data(), huffman::PART_SIZE, MPI::CHAR,
-                           output.data(), huffman::PART_SIZE, MPI::CHAR,
-                           MASTER_RANK);
+    intact = intact && blocks_intact;
+    return suboutput;
+}
+
+// start snippet mpi_generate
+void mpi_generate(const Options &options) {
+    init_threads(options);
+    int rank = MPI::COMM_WORLD.Get_rank();
+    int world_size = MPI::COMM_WORLD.Get_size();
+    std::string alphabet;
+    unsigned long long seed = options.seed;
     if (rank == MASTER_RANK) {
-        std::cout << output;
+        alphabet = (std::ostringstream{} << std::cin.rdbuf()).str();
+        if (!options.seeded) {
+            seed = std::random_device{}();
+        }
+    }
+    alphabet.resize(ALPHABET_SIZE);
+    MPI::COMM_WORLD.Bcast(alphabet.data(), ALPHABET_SIZE, MPI::CHAR, MASTER_RANK);
+    MPI::COMM_WORLD.Bcast(&seed, 1, MPI::UNSIGNED_LONG_LONG, MASTER_RANK);
+    auto table = generator::alias_table(alphabet, generator::zipf_weights(ALPHABET_SIZE, options.zipf));
+    size_t size = options.size != 0 ? options.size : static_cast<size_t>(world_size) * huffman::PART_SIZE;
+
+    // rounds of whole chunks, every rank generates a contiguous range of each round
+    // while its range of the previous round is being written
+    auto out = open_output(options);
+    size_t round_size = static_cast<size_t>(world_size) * (64 << 20);
+    Transfer writes[2];
+    long r = 0;
+    for (size_t position = 0; position < size; position += round_size, ++r) {
+        auto bounds = split(std::min(round_size, size - position), world_size, generator::CHUNK_SIZE);
+        std::string part(bounds[rank + 1] - bounds[rank], '\0');
+        long chunks = static_cast<long>((part.size() + generator::CHUNK_SIZE - 1) / generator::CHUNK_SIZE);
+        {
+            stats::Timer timer(stats::GENERATE, part.size());
+#pragma omp parallel for
+            for (long i = 0; i < chunks; ++i) {
+                size_t offset = i * generator::CHUNK_SIZE;
+                generator::generate_chunk(table, seed, (position + bounds[rank] + offset) / generator::CHUNK_SIZE,
+                                          options.run_length, part.data() + offset,
+                                          std::min(part.size() - offset, generator::CHUNK_SIZE));
+            }
+        }
+        finish_write(writes[(r + 1) % 2], out, rank);
+        start_write(writes[r % 2], out, std::move(part), rank, world_size);
     }
+    finish_write(writes[(r + 1) % 2], out, rank);
+    close_output(out);
+    stats::report(std::cerr, rank, world_size, MASTER_RANK);
     MPI::Finalize();
 }
 // end snippet mpi_generate
@@ -0,0 +1,77 @@
+#include "mapped_file.h"
+
+#include <utility>
+#include <system_error>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+MappedFile::MappedFile(int fd) {
+    struct stat info{};
+    if (fstat(fd, &info) != 0) {
+        throw std::system_error(errno, std::generic_category(), "fstat");
+    }
+    // like a read, the view starts at the current position of the descriptor
+    off_t position = lseek(fd, 0, SEEK_CUR);
+    if (S_ISREG(info.st_mode) && position >= 0 && position < info.st_size) {
+        void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            address = mapping;
+            length = info.st_size;
+            start = position;
+            madvise(address, length, MADV_SEQUENTIAL);
+            return;
+        }
+    }
+    const size_t CHUNK = 1 << 20;
+    for (;;) {
+        size_t size = buffer.size();
+        buffer.resize(size + CHUNK);
+        ssize_t got = read(fd, buffer.data() + size, CHUNK);
+        if (got < 0 && errno == EINTR) {
+            buffer.resize(size);
+            continue;
+        }
+        if (got < 0) {
+            throw std::system_error(errno, std::generic_category(), "read");
+        }
+        buffer.resize(size + got);
+        if (got == 0) {
+            break;
+        }
+    }
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+    : address(std::exchange(other.address, nullptr)),
+      length(std::exchange(other.length, 0)),
+      start(std::exchange(other.start, 0)),
+      buffer(std::move(other.buffer)) {
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept {
+    if (this != &other) {
+        if (address != nullptr) {
+            munmap(address, length);
+        }
+        address = std::exchange(other.address, nullptr);
+        length = std::exchange(other.length, 0);
+        start = std::exchange(other.start, 0);
+        buffer = std::move(other.buffer);
+    }
+    return *this;
+}
+
+MappedFile::~MappedFile() {
+    if (address != nullptr) {
+        munmap(address, length);
+    }
+}
+
+std::string_view MappedFile::view() const {
+    if (address != nullptr) {
+        return {static_cast<const char *>(address) + start, length - start};
+    }
+    return buffer;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+// Read-only view of a whole file: mapped when it is a regular file, read into memory otherwise (pipes, terminals)
+class MappedFile {
+public:
+    MappedFile() = default;
+    explicit MappedFile(int fd);
+    MappedFile(MappedFile &&other) noexcept;
+    MappedFile &operator=(MappedFile &&other) noexcept;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile();
+
+    std::string_view view() const;
+    bool mapped() const { return address != nullptr; }
+
+private:
+    void *address = nullptr;
+    size_t length = 0;
+    size_t start = 0; // position of the descriptor when it was mapped
+    std::string buffer; // when the file can not be mapped
+};
@@ -2,8 +2,15 @@
 // Created by mhq on 27/02/23.
 //
 #include "runlength.h"
-#include <cassert>
+#include "crc32c.h"
+#include "check.h"
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <sstream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 struct Code {
     char byte;
@@ -11,43 +18,474 @@ struct Code {
 };
 
 rle::EncodingStats rle::encode(std::istream& is, std::ostream& os) {
-    Code current;
+    std::string input = (std::ostringstream{} << is.rdbuf()).str();
+    std::string output;
+    auto stats = encode(input.data(), input.size(), output);
+    os.write(output.data(), static_cast<std::streamsize>(output.size()));
+    return stats;
+}
+
+// Length of the run of data[0] starting at data, at most size
+size_t rle::run_length(const char* data, size_t size) {
+    size_t i = 1;
+#ifdef __SSE2__
+    const __m128i byte = _mm_set1_epi8(data[0]);
+    for (; i + 16 <= size; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        auto mismatch = static_cast<unsigned>(~_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, byte)) & 0xffff);
+        if (mismatch != 0) {
+            return i + __builtin_ctz(mismatch);
+        }
+    }
+#endif
+    while (i < size && data[i] == data[0]) {
+        i++;
+    }
+    return i;
+}
+
+rle::EncodingStats rle::encode(const char* data, size_t size, std::string& out) {
     rle::EncodingStats stats{};
-    size_t overbytes;
-    while (is.get(current.byte)) {
-        current.count = 1;
-        overbytes = 0;
-        while (is.peek() == current.byte) {
-            current.count++;
-            if (current.count == 0) {
-                overbytes++;
-            }
-            is.get();
-        }
-        if (overbytes > 0) {
-            Code over = {current.byte, 0};
-            for (size_t i = 0; i < overbytes; ++i) {
-                os.write(reinterpret_cast<char*>(&over), sizeof(over));
-                stats.output_size += 2;
-                stats.input_size += 0x100;
-            }
-            if (current.count == 0) {
+    size_t position = out.size();
+    out.resize(position + 2 * size);
+    for (size_t i = 0; i < size; ) {
+        size_t run = run_length(data + i, size - i);
+        // every 0x100 bytes of a run wrap the counter and are written as {byte, 0}
+        Code current{data[i], 0};
+        for (size_t over = run / 0x100; over > 0; --over) {
+            std::memcpy(out.data() + position, &current, sizeof(current));
+            position += sizeof(current);
+        }
+        current.count = static_cast<uint8_t>(run % 0x100);
+        if (current.count != 0) {
+            std::memcpy(out.data() + position, &current, sizeof(current));
+            position += sizeof(current);
+        }
+        i += run;
+    }
+    stats.input_size = size;
+    stats.output_size = position - (out.size() - 2 * size);
+    out.resize(position);
+    return stats;
+}
+
+// A zero count is a run of 0x100 bytes that wrapped the counter
+void rle::decode(const char* data, size_t size, std::string& out) {
+    size_t pairs = size / sizeof(Code);
+    size_t output_size = 0;
+    for (size_t i = 0; i < pairs; ++i) {
+        auto count = static_cast<uint8_t>(data[2 * i + 1]);
+        output_size += count == 0 ? 0x100 : count;
+    }
+    constexpr size_t SLACK = 16;
+    size_t position = out.size();
+    out.resize(position + output_size + SLACK);
+    for (size_t i = 0; i < pairs; ++i) {
+        char byte = data[2 * i];
+        auto count = static_cast<uint8_t>(data[2 * i + 1]);
+        size_t run = count == 0 ? 0x100 : count;
+        char* target = out.data() + position;
+#ifdef __SSE2__
+        if (run <= SLACK) {
+            // one unaligned store is cheaper than memset for short runs, the slack absorbs the overshoot
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(target), _mm_set1_epi8(byte));
+            position += run;
+            continue;
+        }
+#endif
+        std::memset(target, byte, run);
+        position += run;
+    }
+    out.resize(position);
+}
+
+static void put_varint(std::string& out, uint64_t value) {
+    for (; value >= 0x80; value >>= 7) {
+        out.push_back(static_cast<char>(value | 0x80));
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+// Returns false on a truncated varint
+static bool get_varint(const char* data, size_t size, size_t& position, uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; position < size && shift < 64; shift += 7) {
+        auto byte = static_cast<unsigned char>(data[position++]);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The last run of the block is `tail` bytes longer than it is in data
+rle::EncodingStats rle::encode_block(const char* data, size_t size, size_t tail, std::string& out, uint8_t flags) {
+    std::string packets;
+    packets.reserve(size + size / 64 + 16);
+    size_t literal = 0; // start of pending literal bytes
+    auto flush_literal = [&](size_t end) {
+        if (end > literal) {
+            put_varint(packets, (end - literal - 1) << 1);
+            packets.append(data + literal, end - literal);
+        }
+    };
+    for (size_t i = 0; i < size; ) {
+        size_t run = run_length(data + i, size - i);
+        size_t length = i + run == size ? run + tail : run;
+        if (length >= MIN_RUN) {
+            flush_literal(i);
+            put_varint(packets, (length - 1) << 1 | 1u);
+            packets.push_back(data[i]);
+            literal = i + run;
+        }
+        i += run;
+    }
+    if (size > literal) {
+        // a short last run keeps its tail bytes in the literal
+        put_varint(packets, (size + tail - literal - 1) << 1);
+        packets.append(data + literal, size - literal);
+        packets.append(tail, data[size - 1]);
+    }
+    size_t start = out.size();
+    put_varint(out, size + tail);
+    if (flags & CHECKSUMS) {
+        uint32_t crc = crc32c::checksum(data, size);
+        std::string repeated(std::min(tail, static_cast<size_t>(1) << 16), size > 0 ? data[size - 1] : '\0');
+        for (size_t done = 0; done < tail; done += repeated.size()) {
+            crc = crc32c::extend(crc, repeated.data(), std::min(tail - done, repeated.size()));
+        }
+        put_varint(out, sizeof(crc) + packets.size());
+        out.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+    } else {
+        put_varint(out, packets.size());
+    }
+    out += packets;
+    return {out.size() - start, size + tail};
+}
+
+// Returns the bytes of the block consumed, 0 for a malformed block
+size_t rle::decode_block(const char* data, size_t size, std::string& out, uint8_t flags) {
+    size_t position = 0;
+    uint64_t raw_size;
+    uint64_t packed_size;
+    size_t checksum = flags & CHECKSUMS ? sizeof(uint32_t) : 0;
+    if (!get_varint(data, size, position, raw_size) || !get_varint(data, size, position, packed_size)
+        || packed_size > size - position || packed_size < checksum) {
+        return 0;
+    }
+    size_t end = position + packed_size;
+    position += checksum;
+    // the packets have to add up to raw_size before the output is allocated
+    uint64_t total = 0;
+    for (size_t next = position; next < end; ) {
+        uint64_t control;
+        if (!get_varint(data, end, next, control)) {
+            return 0;
+        }
+        uint64_t length = (control >> 1) + 1;
+        uint64_t stored = control & 1u ? 1 : length;
+        if (length > raw_size - total || stored > end - next) {
+            return 0;
+        }
+        total += length;
+        next += stored;
+    }
+    if (total != raw_size) {
+        return 0;
+    }
+    size_t output = out.size();
+    out.resize(output + raw_size);
+    while (position < end) {
+        uint64_t control;
+        get_varint(data, end, position, control);
+        uint64_t length = (control >> 1) + 1;
+        if (control & 1u) {
+            std::memset(out.data() + output, data[position++], length);
+        } else {
+            std::memcpy(out.data() + output, data + position, length);
+            position += length;
+        }
+        output += length;
+    }
+    return end;
+}
+
+// Bytes of the block with its head, only the head has to be in data; 0 for a truncated head
+size_t rle::block_length(const char* data, size_t size) {
+    size_t position = 0;
+    uint64_t raw_size;
+    uint64_t packed_size;
+    if (!get_varint(data, size, position, raw_size) || !get_varint(data, size, position, packed_size)
+        || packed_size > SIZE_MAX - position) {
+        return 0;
+    }
+    return position + packed_size;
+}
+
+std::vector<size_t> rle::block_offsets(const char* data, size_t size, size_t position) {
+    std::vector<size_t> offsets;
+    while (position < size) {
+        size_t length = block_length(data + position, size - position);
+        if (length == 0 || length > size - position) {
+            break;
+        }
+        offsets.push_back(position);
+        position += length;
+    }
+    return offsets;
+}
+
+// Decodes the block in memory and compares the CRC32C of its bytes with the stored one
+bool rle::verify_block(const char* data, size_t size) {
+    size_t position = 0;
+    uint64_t raw_size;
+    uint64_t packed_size;
+    uint32_t stored;
+    if (!get_varint(data, size, position, raw_size) || !get_varint(data, size, position, packed_size)
+        || size - position < sizeof(stored)) {
+        return false;
+    }
+    std::memcpy(&stored, data + position, sizeof(stored));
+    std::string out;
+    return decode_block(data, size, out, CHECKSUMS) != 0 && out.size() == raw_size
+        && crc32c::checksum(out.data(), out.size()) == stored;
+}
+
+bool rle::decode_container(const char* data, size_t size, std::string& out) {
+    uint8_t flags = size >= sizeof(Header) ? static_cast<uint8_t>(data[offsetof(Header, flags)]) : 0;
+    for (size_t position = sizeof(Header); position < size; ) {
+        size_t consumed = decode_block(data + position, size - position, out, flags);
+        if (consumed == 0) {
+            return false;
+        }
+        position += consumed;
+    }
+    return true;
+}
+
+namespace {
+    // Input and output buffers of the stream decoder, both WINDOW_SIZE bytes
+    struct Window {
+        std::istream& is;
+        std::ostream& os;
+        std::string data = std::string(rle::WINDOW_SIZE, '\0');
+        size_t position = 0;
+        size_t filled = 0;
+        bool end = false;
+        std::string out;
+
+        Window(std::istream& is, std::ostream& os) : is(is), os(os) {}
+
+        // Whether `count` bytes follow `position`, reads more when they do not
+        bool need(size_t count) {
+            if (filled - position < count && !end) {
+                std::memmove(data.data(), data.data() + position, filled - position);
+                filled -= position;
+                position = 0;
+                is.read(data.data() + filled, static_cast<std::streamsize>(data.size() - filled));
+                filled += is.gcount();
+                end = !is;
+            }
+            return filled - position >= count;
+        }
+        size_t available() const {
+            return filled - position;
+        }
+        void flush(size_t keep) {
+            if (out.size() > keep) {
+                os.write(out.data(), static_cast<std::streamsize>(out.size()));
+                out.clear();
+            }
+        }
+    };
+
+    constexpr size_t MAX_VARINT = 10;
+    constexpr size_t BATCH_PAIRS = rle::WINDOW_SIZE / 0x100; // at most WINDOW_SIZE bytes decoded
+
+    void decode_pairs(Window& window) {
+        while (window.need(sizeof(Code))) {
+            size_t size = std::min(window.available() / sizeof(Code), BATCH_PAIRS) * sizeof(Code);
+            rle::decode(window.data.data() + window.position, size, window.out);
+            window.position += size;
+            window.flush(rle::WINDOW_SIZE);
+        }
+    }
+
+    bool read_varint(Window& window, uint64_t& value) {
+        window.need(MAX_VARINT);
+        return get_varint(window.data.data(), window.filled, window.position, value);
+    }
+
+    // Blocks are decoded packet by packet, so a block does not have to fit into memory.
+    // False on a malformed block
+    bool decode_blocks(Window& window, uint8_t flags) {
+        uint64_t raw_size;
+        uint64_t packed_size;
+        while (window.need(1)) {
+            if (!read_varint(window, raw_size) || !read_varint(window, packed_size)) {
+                return false;
+            }
+            if (flags & rle::CHECKSUMS) {
+                if (packed_size < sizeof(uint32_t) || !window.need(sizeof(uint32_t))) {
+                    return false;
+                }
+                window.position += sizeof(uint32_t);
+                packed_size -= sizeof(uint32_t);
+            }
+            while (packed_size != 0) {
+                window.need(MAX_VARINT); // the control varint is read without moving the window
+                size_t start = window.position;
+                uint64_t control;
+                if (!read_varint(window, control)) {
+                    return false;
+                }
+                uint64_t length = (control >> 1) + 1;
+                if (length > raw_size || window.position - start > packed_size) {
+                    return false;
+                }
+                packed_size -= window.position - start;
+                raw_size -= length;
+                uint64_t stored = control & 1u ? 1 : length;
+                if (stored > packed_size) {
+                    return false;
+                }
+                packed_size -= stored;
+                if (control & 1u) {
+                    if (!window.need(1)) {
+                        return false;
+                    }
+                    char byte = window.data[window.position++];
+                    for (uint64_t done = 0; done < length; ) {
+                        size_t piece = std::min(length - done, rle::WINDOW_SIZE);
+                        window.out.append(piece, byte);
+                        done += piece;
+                        window.flush(rle::WINDOW_SIZE - 1);
+                    }
+                    continue;
+                }
+                for (uint64_t done = 0; done < length; ) {
+                    if (!window.need(1)) {
+                        return false;
+                    }
+                    size_t piece = std::min(length - done, static_cast<uint64_t>(window.available()));
+                    window.out.append(window.data.data() + window.position, piece);
+                    window.position += piece;
+                    done += piece;
+                    window.flush(rle::WINDOW_SIZE - 1);
+                }
+            }
+            if (raw_size != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+// Bounded memory: WINDOW_SIZE bytes in and out at a time, a pair or a packet cut by a window is carried over.
+// False on a malformed compact container, the blocks before the malformed one are written
+bool rle::decode(std::istream& is, std::ostream& os) {
+    Window window{is, os};
+    window.need(sizeof(Header));
+    bool intact = true;
+    if (container::has_magic(window.data.data(), window.available(), CONTAINER)) {
+        auto flags = static_cast<uint8_t>(window.data[offsetof(Header, flags)]);
+        window.position = sizeof(Header);
+        intact = decode_blocks(window, flags);
+    } else {
+        decode_pairs(window);
+    }
+    window.flush(0);
+    return intact;
+}
+
+rle::SliceEdges rle::slice_edges(const char* data, size_t size) {
+    if (size == 0) {
+        return {0, 0, '\0', '\0'};
+    }
+    return {size, run_length(data, size), data[0], data[size - 1]};
+}
+
+std::vector<rle::Stitch> rle::stitch(const std::vector<SliceEdges>& slices) {
+    std::vector<Stitch> result(slices.size(), Stitch{0, 0});
+    size_t owner = slices.size(); // slice whose last run is still open
+    for (size_t i = 0; i < slices.size(); ++i) {
+        if (slices[i].size == 0) {
+            continue;
+        }
+        if (owner != slices.size() && slices[owner].last == slices[i].first) {
+            result[i].skip = slices[i].lead;
+            result[owner].tail += slices[i].lead;
+            if (slices[i].lead == slices[i].size) {
                 continue;
             }
         }
-        os.write(reinterpret_cast<char*>(&current), sizeof(current));
-        stats.output_size += 2;
-        stats.input_size += current.count;
+        owner = i;
     }
-    return stats;
+    return result;
+}
+
+// Encodes the slices of subject as the ranks and threads of encode_rle --compact do
+static std::string encode_slices(const std::string& subject, const std::vector<size_t>& bounds, uint8_t flags) {
+    std::vector<rle::SliceEdges> edges;
+    for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+        edges.push_back(rle::slice_edges(subject.data() + bounds[i], bounds[i + 1] - bounds[i]));
+    }
+    auto stitches = rle::stitch(edges);
+    rle::Header header = rle::CONTAINER;
+    header.flags = flags;
+    std::string coded(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+        auto [skip, tail] = stitches[i];
+        size_t size = bounds[i + 1] - bounds[i];
+        if (size > skip) {
+            rle::encode_block(subject.data() + bounds[i] + skip, size - skip, tail, coded, flags);
+        }
+    }
+    return coded;
 }
 
-void rle::decode(std::istream& is, std::ostream& os) {
-    Code current;
-    while(is.read(reinterpret_cast<char*>(&current), sizeof(current))) {
-        assert(is.gcount() == sizeof(current));
-        for (int i = 0; i < current.count; ++i) {
-            os.put(current.byte);
+void test_rle() {
+    // runs cross the cuts, a slice can be one run or empty, short runs keep their tail bytes in a literal
+    std::string small{"abbbbbbbbbbbbcddeeeeeeeeeeeeeeeeeeeeeeeeeeefgg"};
+    for (uint8_t flags : {uint8_t{0}, uint8_t{rle::CHECKSUMS}}) {
+        for (size_t first = 0; first <= small.size(); ++first) {
+            for (size_t second = first; second <= small.size(); ++second) {
+                std::string coded = encode_slices(small, {0, first, second, small.size()}, flags);
+                std::string output;
+                bool intact = rle::decode_container(coded.data(), coded.size(), output);
+                CHECK(intact && output == small);
+            }
         }
     }
-}
\ No newline at end of file
+    // the stream decoder carries packets over its windows
+    std::string large;
+    for (size_t i = 0; large.size() < 3 * rle::WINDOW_SIZE; ++i) {
+        large.append(i % 5 == 0 ? 100'000 : i % 7, static_cast<char>('a' + i % 3));
+    }
+    for (uint8_t flags : {uint8_t{0}, uint8_t{rle::CHECKSUMS}}) {
+        std::string coded = encode_slices(large, {0, large.size() / 4, large.size() / 2, large.size()}, flags);
+        std::istringstream is{coded};
+        std::ostringstream os;
+        bool intact = rle::decode(is, os);
+        CHECK(intact && os.str() == large);
+    }
+    // a raw size that the packets do not add up to is malformed
+    std::string block;
+    rle::encode_block(small.data(), small.size(), 0, block, rle::CHECKSUMS);
+    CHECK(rle::verify_block(block.data(), block.size()));
+    size_t position = 0;
+    uint64_t raw_size;
+    get_varint(block.data(), block.size(), position, raw_size);
+    for (uint64_t corrupted : {raw_size - 1, raw_size + 1, uint64_t{1} << 60}) {
+        std::string tampered;
+        put_varint(tampered, corrupted);
+        tampered.append(block, position);
+        std::string output;
+        size_t consumed = rle::decode_block(tampered.data(), tampered.size(), output, rle::CHECKSUMS);
+        CHECK(consumed == 0 && output.empty());
+    }
+    block.back() ^= 1;
+    CHECK(!rle::verify_block(block.data(), block.size()));
+}
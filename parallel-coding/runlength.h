@@ -1,12 +1,56 @@
 #pragma once
+#include "container.h"
+
 #include <ostream>
 #include <istream>
+#include <string>
+#include <vector>
+#include <cstdint>
 
 namespace rle {
     struct EncodingStats {
         size_t output_size; // bytes
         size_t input_size; // bytes
     };
+    constexpr size_t WINDOW_SIZE = 1 << 20; // bytes the stream decoder reads and writes at a time
+
     EncodingStats encode(std::istream& is, std::ostream& os);
-    void decode(std::istream& is, std::ostream& os);
-}
\ No newline at end of file
+    bool decode(std::istream& is, std::ostream& os); // pairs or a compact container, false when malformed
+    EncodingStats encode(const char* data, size_t size, std::string& out);
+    void decode(const char* data, size_t size, std::string& out);
+    size_t run_length(const char* data, size_t size);
+
+    // Compact container: Header | (varint raw size, varint packed size, packets)*
+    // A packet starts with varint (length - 1) << 1 | repeat, followed by one byte
+    // of a repeat run or by `length` literal bytes.
+    // With CHECKSUMS the packed bytes start with the uint32_t CRC32C of the raw bytes of the block.
+    using container::Header;
+    constexpr Header CONTAINER{{'P', 'C', 'R', 'L'}, 1, 0, 0};
+    enum Flag : uint8_t {
+        CHECKSUMS = 1 << 0,
+    };
+    constexpr size_t MIN_RUN = 3; // shorter runs stay in literal packets
+    constexpr size_t MAX_BLOCK_HEAD = 20; // two varints
+
+    EncodingStats encode_block(const char* data, size_t size, size_t tail, std::string& out, uint8_t flags);
+    size_t decode_block(const char* data, size_t size, std::string& out, uint8_t flags);
+    bool verify_block(const char* data, size_t size);
+    size_t block_length(const char* data, size_t size);
+    std::vector<size_t> block_offsets(const char* data, size_t size, size_t position);
+    bool decode_container(const char* data, size_t size, std::string& out);
+
+    // Runs cut at slice boundaries are merged into the first slice that holds them
+    struct SliceEdges {
+        uint64_t size;
+        uint64_t lead; // bytes of the first run
+        char first;
+        char last;
+    };
+    struct Stitch {
+        uint64_t skip; // bytes of the first run that an earlier slice encodes
+        uint64_t tail; // bytes that later slices add to the last run
+    };
+    SliceEdges slice_edges(const char* data, size_t size);
+    std::vector<Stitch> stitch(const std::vector<SliceEdges>& slices);
+}
+void test_rle();
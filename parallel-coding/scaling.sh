@@ -0,0 +1,47 @@
+#!/bin/sh
+# Strong and weak scaling of the MPI commands over rank counts, CSV on stdout
+# usage: scaling.sh BUILD_DIR [MAX_RANKS] [MIB_PER_RANK] [KIND]
+# strong: MAX_RANKS * MIB_PER_RANK MiB for every rank count, weak: MIB_PER_RANK MiB per rank
+set -e
+build=$1
+max_ranks=${2:-4}
+mib=${3:-16}
+kind=${4:-text}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+now() {
+    date +%s.%N
+}
+
+# run MODE RANKS BYTES COMMAND ARGS..., wall time includes the mpirun startup
+run() {
+    mode=$1 ranks=$2 bytes=$3 command=$4
+    shift 4
+    start=$(now)
+    mpirun -np "$ranks" "$build/parallel_coding" "$command" "$@" 2>/dev/null
+    end=$(now)
+    awk -v s="$start" -v e="$end" -v b="$bytes" -v prefix="$mode,$ranks,$bytes,$command" \
+        'BEGIN { printf "%s,%.6f,%.3f\n", prefix, e - s, b / 1e6 / (e - s) }'
+}
+
+# sweep MODE RANKS BYTES
+sweep() {
+    mode=$1 ranks=$2 bytes=$3
+    corpus=$work/$kind.$bytes
+    [ -f "$corpus" ] || "$build/benchmark" corpus "$kind" "$bytes" > "$corpus"
+    run "$mode" "$ranks" "$bytes" encode_huffman "$corpus" --output "$work/huffman"
+    run "$mode" "$ranks" "$bytes" decode_huffman --input "$work/huffman" --output "$work/decoded"
+    cmp -s "$corpus" "$work/decoded" || echo "decode_huffman mismatch at $ranks ranks" >&2
+    run "$mode" "$ranks" "$bytes" encode_rle --compact --input "$corpus" --output "$work/rle"
+    run "$mode" "$ranks" "$bytes" decode_rle --input "$work/rle" --output "$work/decoded"
+    cmp -s "$corpus" "$work/decoded" || echo "decode_rle mismatch at $ranks ranks" >&2
+}
+
+echo "mode,ranks,size,command,seconds,mb_per_s"
+ranks=1
+while [ "$ranks" -le "$max_ranks" ]; do
+    sweep strong "$ranks" $((max_ranks * mib << 20))
+    sweep weak "$ranks" $((ranks * mib << 20))
+    ranks=$((ranks * 2))
+done
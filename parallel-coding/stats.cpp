@@ -0,0 +1,85 @@
+#include "stats.h"
+
+#include <array>
+#include <iomanip>
+
+#include <mpi.h>
+
+stats::Format stats::format = stats::OFF;
+
+static const char *NAMES[stats::PHASES] = {
+    "read", "scatter", "generate", "histogram", "allreduce", "coding", "encode", "decode", "gather", "write"
+};
+static double epoch;
+static std::array<double, stats::PHASES> seconds;
+static std::array<unsigned long long, stats::PHASES> bytes;
+
+void stats::start(Format report_format) {
+    format = report_format;
+    epoch = MPI::Wtime();
+}
+
+stats::Timer::Timer(Phase phase, uint64_t bytes) : phase(phase), bytes(bytes), start(0) {
+    if (format != OFF) {
+        start = MPI::Wtime();
+    }
+}
+
+stats::Timer::~Timer() {
+    if (format != OFF) {
+        seconds[phase] += MPI::Wtime() - start;
+        ::bytes[phase] += bytes;
+    }
+}
+
+void stats::report(std::ostream& os, int rank, int world_size, int root) {
+    if (format == OFF) {
+        return;
+    }
+    // the last slot is the whole run
+    std::array<double, PHASES + 1> local{};
+    std::copy(seconds.begin(), seconds.end(), local.begin());
+    local[PHASES] = MPI::Wtime() - epoch;
+    std::array<double, PHASES + 1> min{};
+    std::array<double, PHASES + 1> max{};
+    std::array<double, PHASES + 1> sum{};
+    std::array<unsigned long long, PHASES> total_bytes{};
+    MPI::COMM_WORLD.Reduce(local.data(), min.data(), PHASES + 1, MPI::DOUBLE, MPI::MIN, root);
+    MPI::COMM_WORLD.Reduce(local.data(), max.data(), PHASES + 1, MPI::DOUBLE, MPI::MAX, root);
+    MPI::COMM_WORLD.Reduce(local.data(), sum.data(), PHASES + 1, MPI::DOUBLE, MPI::SUM, root);
+    MPI::COMM_WORLD.Reduce(bytes.data(), total_bytes.data(), PHASES, MPI::UNSIGNED_LONG_LONG, MPI::SUM, root);
+    if (rank != root) {
+        return;
+    }
+    auto name = [](int phase) {
+        return phase == PHASES ? "total" : NAMES[phase];
+    };
+    if (format == JSON) {
+        os << "{\"ranks\": " << world_size << ", \"phases\": [";
+        for (int phase = 0; phase <= PHASES; ++phase) {
+            os
+                << (phase == 0 ? "" : ", ")
+                << "{\"phase\": \"" << name(phase) << "\", \"min\": " << min[phase]
+                << ", \"mean\": " << sum[phase] / world_size << ", \"max\": " << max[phase]
+                << ", \"bytes\": " << (phase == PHASES ? 0 : total_bytes[phase]) << '}';
+        }
+        os << "]}\n";
+        return;
+    }
+    os
+        << std::left << std::setw(12) << "phase" << std::right
+        << std::setw(12) << "min, s" << std::setw(12) << "mean, s" << std::setw(12) << "max, s"
+        << std::setw(12) << "max/mean" << std::setw(16) << "bytes" << '\n';
+    for (int phase = 0; phase <= PHASES; ++phase) {
+        if (max[phase] == 0 && (phase == PHASES || total_bytes[phase] == 0)) {
+            continue;
+        }
+        double mean = sum[phase] / world_size;
+        os
+            << std::left << std::setw(12) << name(phase) << std::right << std::fixed << std::setprecision(6)
+            << std::setw(12) << min[phase] << std::setw(12) << mean << std::setw(12) << max[phase]
+            << std::setprecision(2) << std::setw(12) << (mean > 0 ? max[phase] / mean : 1.0)
+            << std::setw(16) << (phase == PHASES ? 0 : total_bytes[phase]) << '\n';
+    }
+    os << std::defaultfloat;
+}
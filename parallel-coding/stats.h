@@ -0,0 +1,28 @@
+#pragma once
+#include <cstdint>
+#include <ostream>
+
+namespace stats {
+    enum Phase {
+        READ, SCATTER, GENERATE, HISTOGRAM, ALLREDUCE, CODING, ENCODE, DECODE, GATHER, WRITE, PHASES
+    };
+    enum Format {
+        OFF, TEXT, JSON
+    };
+    extern Format format; // timers do nothing while OFF
+
+    void start(Format report_format);
+
+    // Adds its lifetime and `bytes` to the phase on this rank
+    struct Timer {
+        Phase phase;
+        uint64_t bytes;
+        double start;
+
+        explicit Timer(Phase phase, uint64_t bytes = 0);
+        ~Timer();
+    };
+
+    // Collective: min, mean and max over the ranks, printed on `root`
+    void report(std::ostream& os, int rank, int world_size, int root);
+}